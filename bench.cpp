@@ -0,0 +1,246 @@
+// Microbenchmarks of the game's hot functions: drawing rectangles and lines of text, drawing the map, collision detection and loading maps.
+// Everything runs headless, drawing into offscreen surfaces, on synthetic maps of 10^2 to 10^6 platforms. Results go to stdout
+// (or to the file given with --out) as JSON, to be kept and compared between versions. Build with `make bench`, run from the
+// directory the game runs from, as the charset, the unicorn's sprites and the platform tiles get loaded from ./resources. Missing images
+// are replaced by synthetic ones, or the tiled benchmarks skipped, so that it also runs from a clean checkout.
+#define RUA_NO_MAIN
+#include "main.cpp"
+
+#define BENCH_REPETITIONS 5 // Times every benchmark is run. The median and the minimum of them are reported.
+#define BENCH_MIN_SECONDS 0.02 // Iterations are doubled until a single repetition takes at least this long.
+#define BENCH_MAP_SPACING 150 // Average distance between the starts of two platforms of a synthetic map, so its length grows with the platforms.
+#define BENCH_MAP_HEIGHT 1200
+
+typedef void (*BenchFunction)(void *context, long long iterations);
+
+struct BenchResult {
+    long long iterations; // Per repetition.
+    double median_ns, min_ns; // Per iteration.
+};
+
+// The JSON output, one object per benchmark.
+struct BenchReport {
+    FILE *out;
+    int count;
+};
+
+double bench_seconds(BenchFunction function, void *context, long long iterations) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    function(context, iterations);
+    return (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+BenchResult run_bench(BenchFunction function, void *context) {
+    BenchResult result;
+    double times[BENCH_REPETITIONS];
+    result.iterations = 1;
+    while (bench_seconds(function, context, result.iterations) < BENCH_MIN_SECONDS) result.iterations *= 2; // Also warms the caches up.
+    for (int r = 0; r < BENCH_REPETITIONS; r++) times[r] = bench_seconds(function, context, result.iterations) * 1e9 / result.iterations;
+    qsort(times, BENCH_REPETITIONS, sizeof(double), compare_doubles);
+    result.median_ns = times[BENCH_REPETITIONS / 2];
+    result.min_ns = times[0];
+    return result;
+}
+
+// Run a benchmark and add its result to the report. platforms is the size of the map it ran on, 0 if none.
+void report_bench(BenchReport *report, const char *name, const char *variant, int platforms, BenchFunction function, void *context) {
+    BenchResult result = run_bench(function, context);
+    fprintf(report->out, "%s\n    {\"name\": \"%s\", \"variant\": \"%s\", ", report->count++ > 0 ? "," : "", name, variant);
+    if (platforms > 0) fprintf(report->out, "\"platforms\": %d, ", platforms);
+    fprintf(report->out, "\"iterations\": %lld, \"median_ns\": %.1f, \"min_ns\": %.1f}", result.iterations, result.median_ns, result.min_ns);
+    fflush(report->out);
+    SDL_Log("%s %s %d: %.1f ns", name, variant, platforms, result.median_ns);
+}
+
+// Write a synthetic map of the given number of platforms to path as a text map: platforms about BENCH_MAP_SPACING apart,
+// of random widths, heights and altitudes, so that the screen always shows about the same number of them.
+void write_bench_map(const char *path, int platforms, Uint32 seed) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        SDL_Log("Error writing the benchmark map %s!", path);
+        exit(1);
+    }
+    fprintf(file, "%d %d\n%d\n", platforms * BENCH_MAP_SPACING, BENCH_MAP_HEIGHT, platforms);
+    for (int i = 0; i < platforms; i++) {
+        fprintf(file, "%d %d %d %d\n", i * BENCH_MAP_SPACING + (int)(xorshift32(&seed) % 50), 200 + (int)(xorshift32(&seed) % 900),
+            50 + (int)(xorshift32(&seed) % 200), 30 + (int)(xorshift32(&seed) % 30));
+    }
+    fclose(file);
+}
+
+struct RectangleBench {
+    SDL_Surface *surface;
+    int width, height;
+};
+
+void bench_draw_rectangle(void *context, long long iterations) {
+    RectangleBench *bench = (RectangleBench*)context;
+    for (long long i = 0; i < iterations; i++) {
+        int x = (int)(i * 37 % (bench->surface->w - bench->width + 1)), y = (int)(i * 11 % (bench->surface->h - bench->height + 1));
+        DrawRectangle(bench->surface, x, y, bench->width, bench->height, 0xFFFF0000, (Uint32)i);
+    }
+}
+
+struct TextLineBench {
+    Rasterizer *raster;
+    SDL_Surface *glyphs;
+    const char *texts[2]; // Alternated between, so the line is re-rendered every time unless both are the same.
+    TextLine line;
+};
+
+// A frame's worth of a line of the info panel: setting its text, then drawing it.
+void bench_text_line(void *context, long long iterations) {
+    TextLineBench *bench = (TextLineBench*)context;
+    for (long long i = 0; i < iterations; i++) {
+        set_text_line(&bench->line, bench->texts[i % 2], bench->glyphs);
+        DrawTextLine(bench->raster, (int)(i * 8 % 256), (int)(i * 8 % 512), &bench->line);
+        Rasterize(bench->raster);
+    }
+}
+
+struct MapBench {
+    Map *map;
+    Rasterizer *raster;
+    PlatformCache *cache;
+    Unicorn *player;
+    Uint32 seed;
+};
+
+// A frame's worth of drawing the map: recording it, then rasterizing it, while scrolling at the unicorn's speed.
+void bench_draw_map(void *context, long long iterations) {
+    MapBench *bench = (MapBench*)context;
+    for (long long i = 0; i < iterations; i++) {
+        double map_offset = fmod(i * STARTING_X_VELOCITY, bench->map->length);
+        bench->cache->frame++;
+        RasterFill(bench->raster, NULL, 0);
+        draw_map(bench->raster, map_offset, 600, bench->map, bench->cache, 0xFF00FF00, 0xFFA52A2A);
+        Rasterize(bench->raster);
+    }
+}
+
+// The player's collision detection at random places all over the map.
+void bench_detect_collisions(void *context, long long iterations) {
+    MapBench *bench = (MapBench*)context;
+    for (long long i = 0; i < iterations; i++) {
+        bench->player->y = 100 + xorshift32(&bench->seed) % (BENCH_MAP_HEIGHT - 100);
+        bench->player->lives = NUMBER_0F_LIVES; // Dying is part of what's measured, running out of lives isn't.
+        bench->player->detect_collisions(xorshift32(&bench->seed) % (Uint32)bench->map->length, 0, bench->map);
+    }
+}
+
+struct LoadBench {
+    const char *path;
+};
+
+void bench_load_map(void *context, long long iterations) {
+    LoadBench *bench = (LoadBench*)context;
+    Map map;
+    for (long long i = 0; i < iterations; i++) {
+        load_map(bench->path, &map);
+        free_map(&map);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *out_path = NULL;
+    int max_platforms = 1000000, bands = 0;
+    BenchReport report = {stdout, 0};
+    char text_path[64], binary_path[64];
+
+    // --out <file.json> writes the results to a file instead of stdout, --max-platforms <n> limits the size of the synthetic maps,
+    // --bands <n> sets the number of rasterizer bands for the multi-threaded map drawing (0 = one per core, the default).
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) out_path = argv[++i];
+        else if (strcmp(argv[i], "--max-platforms") == 0 && i + 1 < argc) max_platforms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bands") == 0 && i + 1 < argc) bands = atoi(argv[++i]);
+    }
+    if (out_path != NULL && (report.out = fopen(out_path, "w")) == NULL) {
+        SDL_Log("Error writing the results to %s!", out_path);
+        return 1;
+    }
+
+    init_frame_arena(&frame_arena, FRAME_ARENA_BYTES); // Map queries take their results from it, like in the game.
+    SDL_Surface *screen = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    SDL_Surface *charset = SDL_LoadBMP("./resources/cs8x8.bmp");
+    if (charset == NULL) { // Fine for timing, the glyphs don't matter.
+        charset = SDL_CreateRGBSurface(0, 128, 128, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+        SDL_FillRect(charset, NULL, 0x00FFFFFF);
+    }
+    SDL_SetColorKey(charset, true, 0x000000);
+    SDL_Surface *glyphs = SDL_ConvertSurfaceFormat(charset, SDL_PIXELFORMAT_RGB888, 0); // The same as the game's.
+    SDL_Surface *spriteA = SDL_LoadBMP("./resources/unicorn-spriteA.bmp"), *spriteB = SDL_LoadBMP("./resources/unicorn-spriteB.bmp");
+    if (spriteA == NULL) spriteA = SDL_CreateRGBSurface(0, 128, 100, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0); // Only the size matters.
+    if (spriteB == NULL) spriteB = SDL_CreateRGBSurface(0, spriteA->w, spriteA->h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+    player.set_sprites(spriteA, spriteB); // Collisions depend on the unicorn's size.
+    fprintf(report.out, "{\n  \"screen\": [%d, %d],\n  \"cpus\": %d,\n  \"benchmarks\": [", SCREEN_WIDTH, SCREEN_HEIGHT, SDL_GetCPUCount());
+
+    RectangleBench rectangles[] = {{screen, 16, 16}, {screen, 256, 50}, {screen, SCREEN_WIDTH, SCREEN_HEIGHT}};
+    const char *rectangle_variants[] = {"16x16", "256x50", "full screen"};
+    for (int r = 0; r < 3; r++) report_bench(&report, "DrawRectangle", rectangle_variants[r], 0, bench_draw_rectangle, &rectangles[r]);
+
+    Rasterizer single, banded;
+    init_rasterizer(&single, screen, 1);
+    init_rasterizer(&banded, screen, bands);
+
+    const char *controls = "Esc - quit, Z - jump, X - dash, D - toggle cheater's controls, N - new game.";
+    TextLineBench lines[] = {
+        {&single, glyphs, {controls, controls}, {}},
+        {&single, glyphs, {"Time elapsed = 12.3 s  60 FPS (Frames Per Second)", "Time elapsed = 12.4 s  59 FPS (Frames Per Second)"}, {}},
+    };
+    const char *line_variants[] = {"76 characters, unchanged", "49 characters, changing every frame"};
+    for (int l = 0; l < 2; l++) {
+        report_bench(&report, "DrawTextLine", line_variants[l], 0, bench_text_line, &lines[l]);
+        free_text_line(&lines[l].line);
+    }
+
+    PlatformCache plain, tiled;
+    memset(&plain, 0, sizeof(plain)); // No tiles, so platforms are drawn as rectangles.
+    init_platform_cache(&tiled, NULL);
+    for (int i = 0; i < PLATFORM_TILES_COUNT; i++) {
+        sprintf(text_path, "./resources/grassy_tile_%d.png", i + 1);
+        SDL_Surface *tile = IMG_Load(text_path);
+        if (tile == NULL) continue;
+        add_platform_tile(&tiled, SDL_ConvertSurfaceFormat(tile, SDL_PIXELFORMAT_ARGB8888, 0));
+        SDL_FreeSurface(tile);
+    }
+    for (int platforms = 100; platforms <= max_platforms; platforms *= 10) {
+        Map map;
+        sprintf(text_path, "bench-map-%d.txt", platforms);
+        sprintf(binary_path, "bench-map-%d.bin", platforms);
+        write_bench_map(text_path, platforms, platforms);
+        if (compile_map(text_path, binary_path) != 0) return 1;
+
+        LoadBench text = {text_path}, binary = {binary_path};
+        report_bench(&report, "load_map", "text", platforms, bench_load_map, &text);
+        report_bench(&report, "load_map", "compiled", platforms, bench_load_map, &binary);
+
+        load_map(text_path, &map);
+        build_map_index(&map.index, map.length, map.elements_count, map.elements);
+        MapBench bench = {&map, &single, &plain, &player, 1};
+        report_bench(&report, "draw_map", "rectangles, 1 thread", platforms, bench_draw_map, &bench);
+        bench.raster = &banded;
+        report_bench(&report, "draw_map", "rectangles, banded", platforms, bench_draw_map, &bench);
+        if (tiled.tiles_count > 0) {
+            bench.cache = &tiled;
+            report_bench(&report, "draw_map", "tiles, banded", platforms, bench_draw_map, &bench);
+        }
+        report_bench(&report, "Unicorn::detect_collisions", "random positions", platforms, bench_detect_collisions, &bench);
+        free_map_index(&map.index);
+        free_map(&map);
+        remove(text_path);
+        remove(binary_path);
+    }
+    fprintf(report.out, "\n  ]\n}\n");
+
+    free_rasterizer(&single);
+    free_rasterizer(&banded);
+    free_platform_cache(&tiled);
+    free_frame_arena(&frame_arena);
+    SDL_FreeSurface(spriteA);
+    SDL_FreeSurface(spriteB);
+    SDL_FreeSurface(glyphs);
+    SDL_FreeSurface(charset);
+    SDL_FreeSurface(screen);
+    if (report.out != stdout) fclose(report.out);
+    return 0;
+}
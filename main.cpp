@@ -2,9 +2,17 @@
 #define M_RAD 57.2958 // One radian equals 57.2958 degrees
 
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define SCREEN_WIDTH	1280
 #define SCREEN_HEIGHT	600
@@ -17,37 +25,427 @@
 #define JUMP_INITIAL_PUSH -3.;
 #define Y_ACC_CONST -0.5
 #define NUMBER_0F_LIVES 3
+#define INDEX_BUCKET_WIDTH 256 // Width of a single map index bucket in pixels. A fraction of the screen width, so a query touches only a few buckets.
+#define MAX_QUERY_RESULTS 4096 // Max number of platforms returned by a single map index query.
+#define GEOMETRY_BATCH_QUADS 8192 // Max number of quads sent to the renderer in a single SDL_RenderGeometry() call.
+#define MAX_ATLAS_FRAMES 32 // Max number of sprites in the sprite atlas.
+#define MAP_FILE_MAGIC "RUAMAP" // First bytes of a compiled map file.
+#define MAP_FILE_VERSION 2 // Bump whenever the layout of compiled map files changes.
+#define MAP_CHUNK_WIDTH 2048 // Width of the chunks compiled maps are split into for streaming.
+#define MAP_STREAM_CHUNKS_AHEAD 2 // How many chunks past the right edge of the screen a streamed map keeps loaded.
+#define DEFAULT_MAP "./map/platforms.txt"
+#define MAX_PENDING_ACTIONS 64 // Max number of inputs queued for a single tick.
+#define INPUT_LOG_MAGIC "RUAREC" // First bytes of a recorded run.
+#define INPUT_LOG_VERSION 2 // Bump whenever the format of recorded runs or the game's physics change.
+#define INPUT_LOG_TICK_END 0xFF // Marks the end of a tick's inputs in a recorded run, followed by the state checksum.
 #define TICK_PERIOD 15 // Number of milliseconds between ticks. The smaller this number, the faster the game goes.
                         // 30 gives a fairly dynamic gameplay
                         // 200 is pretty good for slo-mo gameplay for debugging purposes.
                         // 3 is good for a decent fast-forward.
+#define MAX_TICKS_PER_FRAME 10 // Max number of ticks run to catch up before a single frame. Any backlog beyond that is dropped.
+#define DASH_LENGTH 50 // The number of ticks a dash lasts.
+#define AGENT_BATCH_SIZE 64 // Number of agents a batch simulation worker steps in lockstep.
+#define AGENT_SHARED_QUERY_SPAN (2 * SCREEN_WIDTH) // Agents of a batch this close to each other share a single map query.
+#define DEFAULT_BATCH_TICKS 10000 // Ticks a batch simulation runs for unless told otherwise.
+#define DEFAULT_PACING_FPS 60 // Target frame rate when pacing by time, either because asked to without a number or because vsync isn't available.
+#define PACING_SPIN_MS 2 // How long before a frame is due the pacer stops sleeping and busy-waits instead.
+#define FRAME_TIMES_KEPT 8192 // Number of latest frame times the frame pacing report covers.
+#define ENDLESS_CHUNKS (1 << 20) // Number of chunks of an endless map. It still loops after that, but that takes days.
+#define ENDLESS_MAP_HEIGHT 1200
+#define ENDLESS_ANCHOR_Y 1000 // Height of the platform every chunk of an endless map starts with.
+#define ENDLESS_ANCHOR_WIDTH 300
+#define ENDLESS_PLATFORM_THICKNESS 50
+#define ENDLESS_MIN_GAP 40 // Range of gaps between generated platforms.
+#define ENDLESS_MAX_GAP 400
+#define ENDLESS_MIN_WIDTH 150 // Range of widths of generated platforms.
+#define ENDLESS_MAX_WIDTH 700
+#define ENDLESS_MAX_RISE 250 // How much higher or lower than the one before a generated platform may be.
+#define ENDLESS_MAX_DROP 300
+#define ENDLESS_ATTEMPTS 16 // Random platforms the generator tries before closing a chunk.
+#define ENDLESS_SIMULATION_TICKS 200 // How long a jump is simulated for when checking that a platform is reachable.
+#define ENTITY_POOL_SIZE 1024 // Max number of fairies and stars spawned at once. Records coming into view while the pool is full wait for room.
+#define ENTITY_SPAWN_AHEAD 256 // How far past the right edge of the screen fairies and stars get spawned.
+#define ENTITY_PHASE_STEP 0.1 // Animation phase advance per tick.
+#define FAIRY_SIZE 32
+#define FAIRY_HOVER 10 // How far up and down fairies hover.
+#define STAR_SIZE 48
+#define PLATFORM_TILE_SIZE 64 // Width and height of the grassy tiles platforms are made of.
+#define PLATFORM_TILES_COUNT 6
+#define PLATFORM_CACHE_SIZE 128 // Max number of composed platform images kept around.
+#define PLATFORM_CACHE_BYTES (32 << 20) // Max total size of the composed platform images.
+#define PLATFORM_CACHE_MAX_WIDTH 2048 // Wider platforms repeat an image this wide. A multiple of the tile size, so the repeats line up.
+#define RASTER_MAX_BANDS 16 // Max number of bands the screen surface is split into for drawing on several threads.
+#define MAP_LAYER_DIRTY_RECTS 16 // Max number of strips of the map layer drawn in a single frame.
+#define OVERLAY_DIRTY_RECTS 64 // Max number of rectangles drawn over the map layer tracked for uploading, beyond that the whole screen is uploaded.
+#define ASSETS_MAX 32 // Max number of files loaded by the asset loader.
+#define ASSET_THREADS_MAX 8 // Max number of threads decoding assets at startup.
+#define RESOURCE_CACHE_SIZE 32 // Max number of images kept by the resource cache.
+#define FRAME_ARENA_BYTES (1 << 18) // Size of the per-frame arena. Map queries take the most, up to MAX_QUERY_RESULTS platforms' worth at once.
+#define ALLOCATION_WARMUP_FRAMES 120 // Frames drawn before --check-allocations expects no more heap allocations, while buffers grow to their final sizes.
+#define PROFILE_RING_SIZE 4096 // Number of timing samples the profiler keeps, a power of two. The overlay's statistics cover this many latest samples.
 
 using namespace std;
 
-// draw a text txt on surface screen, starting from the point (x, y)
-// charset is a 128x128 bitmap containing character images
-void DrawString(SDL_Surface *screen, int x, int y, const char *text, SDL_Surface *charset) {
-	int px, py, c;
-	SDL_Rect s, d;
-	s.w = 8;
-	s.h = 8;
-	d.w = 8;
-	d.h = 8;
-	while(*text) {
+// Stages of a frame timed by the profiler.
+enum ProfileStage {
+    STAGE_TICK, // game_tick(), including the collisions.
+    STAGE_COLLISIONS, // Unicorn::detect_collisions().
+    STAGE_MAP, // Drawing the platforms.
+    STAGE_HUD, // Drawing the info panel and its text.
+    STAGE_RASTER, // Replaying the recorded software drawing into the screen surface.
+    STAGE_UPLOAD, // Getting the drawing to the renderer: SDL_UpdateTexture() of the screen surface, or flushing the batched geometry.
+    STAGE_SPRITES, // Copying the sprites.
+    STAGE_PRESENT, // SDL_RenderPresent().
+    STAGES_COUNT
+};
+const char *stage_names[STAGES_COUNT] = {"tick", "collisions", "map", "hud", "raster", "upload", "sprites", "present"};
+
+struct ProfileSample {
+    SDL_atomic_t sequence; // Number of the sample + 1 once it's been written completely, so readers can tell a finished sample from a stale or half written one.
+    int stage, frame;
+    SDL_threadID thread;
+    Uint64 start, end; // Performance counter readings.
+};
+
+// Timing samples of the frame stages, kept in a lock-free ring buffer: any thread claims the next slot with an atomic increment and
+// publishes the sample through the slot's sequence number. Once the ring is full, the oldest samples get overwritten.
+struct Profiler {
+    bool enabled; // Timers cost a single branch while the profiler is off.
+    int frame; // Current frame number, stamped on the samples.
+    Uint64 origin; // Performance counter reading all times are measured from.
+    SDL_atomic_t head; // Number of samples ever written; sample n lives in ring[n % PROFILE_RING_SIZE].
+    int tail, lost; // Next sample to be written to the dump, and how many got overwritten before that could happen.
+    FILE *dump; // Where the samples go for offline analysis, NULL if nowhere.
+    bool dump_json; // Chrome trace JSON (chrome://tracing, Perfetto) rather than CSV.
+    int dumped; // Number of samples written to the dump.
+    ProfileSample ring[PROFILE_RING_SIZE];
+} profiler;
+
+void profile_sample(int stage, Uint64 start, Uint64 end) {
+    int n = SDL_AtomicAdd(&profiler.head, 1);
+    ProfileSample *sample = &profiler.ring[n & (PROFILE_RING_SIZE - 1)];
+    SDL_AtomicSet(&sample->sequence, 0); // Being written.
+    sample->stage = stage;
+    sample->frame = profiler.frame;
+    sample->thread = SDL_ThreadID();
+    sample->start = start;
+    sample->end = end;
+    SDL_AtomicSet(&sample->sequence, n + 1);
+}
+
+// Copy sample n out of the ring. Returns false if it isn't there (yet or anymore).
+bool read_profile_sample(int n, ProfileSample *out) {
+    ProfileSample *sample = &profiler.ring[n & (PROFILE_RING_SIZE - 1)];
+    if (SDL_AtomicGet(&sample->sequence) != n + 1) return false;
+    out->stage = sample->stage;
+    out->frame = sample->frame;
+    out->thread = sample->thread;
+    out->start = sample->start;
+    out->end = sample->end;
+    return SDL_AtomicGet(&sample->sequence) == n + 1; // Not overwritten while being copied.
+}
+
+// Times the enclosing scope as the given stage.
+struct ProfileScope {
+    int stage;
+    Uint64 start;
+    ProfileScope(int stage) : stage(stage), start(profiler.enabled ? SDL_GetPerformanceCounter() : 0) {}
+    ~ProfileScope() {
+        if (profiler.enabled) profile_sample(stage, start, SDL_GetPerformanceCounter());
+    }
+};
+
+// Start profiling, dumping the samples to path (a .json file gets a Chrome trace, anything else CSV) unless that's NULL.
+void start_profiler(const char *path) {
+    const char *extension = path != NULL ? strrchr(path, '.') : NULL;
+    profiler.enabled = true;
+    profiler.origin = SDL_GetPerformanceCounter();
+    if (path == NULL) return;
+    if ((profiler.dump = fopen(path, "w")) == NULL) {
+        SDL_Log("Cannot open %s for writing the profile!", path);
+        return;
+    }
+    profiler.dump_json = extension != NULL && strcmp(extension, ".json") == 0;
+    if (profiler.dump_json) fprintf(profiler.dump, "{\"traceEvents\":[\n");
+    else fprintf(profiler.dump, "stage,frame,thread,start_us,duration_us\n");
+}
+
+// Write the samples taken since the last call to the dump. Called once a frame, so that the ring never has to hold more than a few frames' worth.
+void drain_profiler() {
+    int head = SDL_AtomicGet(&profiler.head);
+    double scale = 1e6 / SDL_GetPerformanceFrequency();
+    ProfileSample sample;
+    if (profiler.dump == NULL) return;
+    if (head - profiler.tail > PROFILE_RING_SIZE) {
+        profiler.lost += head - PROFILE_RING_SIZE - profiler.tail;
+        profiler.tail = head - PROFILE_RING_SIZE;
+    }
+    for (; profiler.tail < head; profiler.tail++) {
+        if (!read_profile_sample(profiler.tail, &sample)) {
+            if (SDL_AtomicGet(&profiler.ring[profiler.tail & (PROFILE_RING_SIZE - 1)].sequence) <= profiler.tail) break; // Claimed but not written yet, try again next time.
+            profiler.lost++; // Already overwritten by a faster thread.
+            continue;
+        }
+        double start = (sample.start - profiler.origin) * scale, duration = (sample.end - sample.start) * scale;
+        if (profiler.dump_json) {
+            fprintf(profiler.dump, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%d}}",
+                profiler.dumped > 0 ? ",\n" : "", stage_names[sample.stage], (unsigned long)sample.thread, start, duration, sample.frame);
+        }
+        else fprintf(profiler.dump, "%s,%d,%lu,%.3f,%.3f\n", stage_names[sample.stage], sample.frame, (unsigned long)sample.thread, start, duration);
+        profiler.dumped++;
+    }
+}
+
+void stop_profiler() {
+    drain_profiler();
+    if (profiler.dump != NULL) {
+        if (profiler.dump_json) fprintf(profiler.dump, "\n]}\n");
+        fclose(profiler.dump);
+        profiler.dump = NULL;
+        if (profiler.lost > 0) SDL_Log("The profiler lost %d samples, they were overwritten before they could be dumped.", profiler.lost);
+    }
+    profiler.enabled = false;
+}
+
+// Heap allocations are counted by wrapping SDL's memory functions, which the game's own allocations go through as well (SDL_malloc() and co.).
+// Whatever calls the C library's malloc() directly goes uncounted, like snprintf() and qsort() may do internally.
+// Once the game has warmed up, a frame shouldn't allocate anything unless something new comes into view, see --check-allocations.
+struct MemoryCounter {
+    SDL_malloc_func malloc;
+    SDL_calloc_func calloc;
+    SDL_realloc_func realloc;
+    SDL_free_func free;
+    SDL_atomic_t allocations; // Allocations and reallocations so far, on every thread.
+} memory_counter;
+
+void* SDLCALL counted_malloc(size_t size) {
+    SDL_AtomicAdd(&memory_counter.allocations, 1);
+    return memory_counter.malloc(size);
+}
+
+void* SDLCALL counted_calloc(size_t count, size_t size) {
+    SDL_AtomicAdd(&memory_counter.allocations, 1);
+    return memory_counter.calloc(count, size);
+}
+
+void* SDLCALL counted_realloc(void *memory, size_t size) {
+    SDL_AtomicAdd(&memory_counter.allocations, 1);
+    return memory_counter.realloc(memory, size);
+}
+
+// Start counting. The first thing to do, before anything gets allocated.
+void count_allocations() {
+    SDL_GetMemoryFunctions(&memory_counter.malloc, &memory_counter.calloc, &memory_counter.realloc, &memory_counter.free);
+    SDL_SetMemoryFunctions(counted_malloc, counted_calloc, counted_realloc, memory_counter.free);
+}
+
+int allocations_count() {
+    return SDL_AtomicGet(&memory_counter.allocations);
+}
+
+// Memory for whatever is only needed within a frame, like map query results and the HUD's strings. It's allocated once up front, handed out
+// by bumping an offset and taken back all at once at the start of every frame, so frames need no heap allocations for it. Main thread only.
+struct FrameArena {
+    Uint8 *memory;
+    size_t size, used;
+} frame_arena;
+
+void init_frame_arena(FrameArena *arena, size_t size) {
+    arena->memory = (Uint8*)SDL_malloc(size);
+    arena->size = arena->memory != NULL ? size : 0;
+    arena->used = 0;
+}
+
+// bytes of memory aligned for anything, valid until the arena is reset. NULL if the arena has no room left.
+void* arena_alloc(FrameArena *arena, size_t bytes) {
+    size_t start = (arena->used + 15) & ~(size_t)15;
+    if (start + bytes > arena->size) {
+        SDL_Log("The frame arena is out of room for %u more bytes!", (unsigned)bytes);
+        return NULL;
+    }
+    arena->used = start + bytes;
+    return arena->memory + start;
+}
+
+// sprintf() into the arena. Returns an empty string if the text doesn't fit.
+const char* arena_printf(FrameArena *arena, const char *format, ...) {
+    va_list args;
+    char *text = (char*)arena->memory + arena->used;
+    size_t room = arena->size - arena->used;
+    va_start(args, format);
+    int length = vsnprintf(text, room, format, args);
+    va_end(args);
+    if (length < 0 || (size_t)length >= room) {
+        SDL_Log("The frame arena is out of room for a %d character string!", length);
+        return "";
+    }
+    arena->used += length + 1;
+    return text;
+}
+
+void reset_frame_arena(FrameArena *arena) {
+    arena->used = 0;
+}
+
+void free_frame_arena(FrameArena *arena) {
+    SDL_free(arena->memory);
+    *arena = {};
+}
+
+// Takes back everything allocated from the arena within the enclosing scope when it ends, for scratch memory not needed for the rest of the frame.
+struct ArenaScope {
+    FrameArena *arena;
+    size_t used;
+    ArenaScope(FrameArena *arena) : arena(arena), used(arena->used) {}
+    ~ArenaScope() {
+        arena->used = used;
+    }
+};
+
+// A reference to a surface, given back when the handle goes away. SDL counts a surface's references itself, so copying a handle adds one
+// and the last handle to go frees the surface. Converts to a plain SDL_Surface* for SDL's functions, which only borrow it.
+class SurfaceHandle {
+    SDL_Surface *surface;
+public:
+    SurfaceHandle() : surface(NULL) {}
+    explicit SurfaceHandle(SDL_Surface *surface) : surface(surface) {} // Takes the caller's reference over.
+    SurfaceHandle(const SurfaceHandle &other) : surface(other.surface) {
+        if (surface != NULL) surface->refcount++;
+    }
+    SurfaceHandle& operator=(const SurfaceHandle &other) {
+        if (other.surface != NULL) other.surface->refcount++; // First, in case it's the same surface.
+        SDL_FreeSurface(surface);
+        surface = other.surface;
+        return *this;
+    }
+    ~SurfaceHandle() {
+        SDL_FreeSurface(surface);
+    }
+    operator SDL_Surface*() const {return surface;}
+    SDL_Surface* operator->() const {return surface;}
+    // Hand the reference over to whoever frees the surface with SDL_FreeSurface() themselves.
+    SDL_Surface* release() {
+        SDL_Surface *released = surface;
+        surface = NULL;
+        return released;
+    }
+};
+
+// The same for a texture. Textures don't count their references, so the handles sharing one count them next to it.
+class TextureHandle {
+    struct Shared {
+        SDL_Texture *texture;
+        int refcount;
+    } *shared;
+    void drop() {
+        if (shared != NULL && --shared->refcount == 0) {
+            SDL_DestroyTexture(shared->texture);
+            SDL_free(shared);
+        }
+        shared = NULL;
+    }
+public:
+    TextureHandle() : shared(NULL) {}
+    explicit TextureHandle(SDL_Texture *texture) : shared(NULL) { // Takes the texture over.
+        if (texture == NULL) return;
+        shared = (Shared*)SDL_malloc(sizeof(Shared));
+        shared->texture = texture;
+        shared->refcount = 1;
+    }
+    TextureHandle(const TextureHandle &other) : shared(other.shared) {
+        if (shared != NULL) shared->refcount++;
+    }
+    TextureHandle& operator=(const TextureHandle &other) {
+        if (other.shared != NULL) other.shared->refcount++;
+        drop();
+        shared = other.shared;
+        return *this;
+    }
+    ~TextureHandle() {
+        drop();
+    }
+    operator SDL_Texture*() const {return shared != NULL ? shared->texture : NULL;}
+};
+
+// Runs a function when the enclosing scope ends, however it ends. main() frees everything it has set up this way, whichever way it returns.
+template <typename Function> struct ScopeExit {
+    Function function;
+    ScopeExit(Function function) : function(function) {}
+    ~ScopeExit() {
+        function();
+    }
+};
+
+// copy the glyphs of the text txt into surface starting from the point (x, y), for pre-rendering text; the charset is a 128x128 bitmap of 8x8 glyphs:
+// glyphs is the charset converted to the format of surface, so every glyph row is copied straight with no blits and no color keying
+void CopyGlyphs(SDL_Surface *surface, int x, int y, const char *text, SDL_Surface *glyphs) {
+	int bpp = glyphs->format->BytesPerPixel, c;
+	Uint8 *row = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
+	for (; *text && x + 8 <= surface->w; text++, x += 8, row += 8 * bpp) {
 		c = *text & 255;
-		px = (c % 16) * 8;
-		py = (c / 16) * 8;
-		s.x = px;
-		s.y = py;
-		d.x = x;
-		d.y = y;
-		SDL_BlitSurface(charset, &s, screen, &d);
-		x += 8;
-		text++;
+		Uint8 *glyph = (Uint8 *)glyphs->pixels + (c / 16) * 8 * glyphs->pitch + (c % 16) * 8 * bpp;
+		for (int r = 0; r < 8; r++) memcpy(row + r * surface->pitch, glyph + r * glyphs->pitch, 8 * bpp);
+	}
+}
+
+// A line of text pre-rendered with the 8x8 charset, so that drawing it takes a single blit (or a single quad) instead of one per character.
+// It's only rendered again when its text changes.
+struct TextLine {
+    char text[128];
+    int width; // In pixels.
+    SDL_Surface *surface; // The rendered line, in the format of the glyphs and with their color key. As wide as the longest possible text,
+                          // so that it's never reallocated, with only the first width pixels in use.
+    SDL_Texture *texture; // The same for the renderer, with the color key turned into transparency.
+    bool uploaded; // Whether the texture is up to date with the surface. Uploaded the first time it's needed after every change.
+};
+
+// Change the text of the line, re-rendering it only if the text is actually different. Returns true if it was.
+bool set_text_line(TextLine *line, const char *text, SDL_Surface *glyphs) {
+    Uint32 key;
+    if (line->surface != NULL && strcmp(line->text, text) == 0) return false;
+    snprintf(line->text, sizeof(line->text), "%s", text);
+    line->width = strlen(line->text) * 8;
+    if (line->surface == NULL) {
+        line->surface = SDL_CreateRGBSurfaceWithFormat(0, (sizeof(line->text) - 1) * 8, 8, glyphs->format->BitsPerPixel, glyphs->format->format);
+        if (SDL_GetColorKey(glyphs, &key) == 0) SDL_SetColorKey(line->surface, true, key);
+    }
+    if (SDL_GetColorKey(line->surface, &key) != 0) key = 0;
+    SDL_FillRect(line->surface, NULL, key); // Whatever a longer text left behind past the end, for the texture's filtering not to pick it up.
+    CopyGlyphs(line->surface, 0, 0, line->text, glyphs);
+    line->uploaded = false;
+    return true;
+}
+
+// The line's texture, a streaming one updated in place whenever the text changes.
+SDL_Texture* text_line_texture(SDL_Renderer *renderer, TextLine *line) {
+    Uint32 key;
+    void *pixels;
+    int pitch;
+    if (line->texture == NULL) {
+        line->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, line->surface->w, line->surface->h);
+        if (line->texture == NULL) return NULL;
+        SDL_SetTextureBlendMode(line->texture, SDL_BLENDMODE_BLEND);
+    }
+    if (!line->uploaded && SDL_LockTexture(line->texture, NULL, &pixels, &pitch) == 0) {
+        if (SDL_GetColorKey(line->surface, &key) != 0) key = 0xFFFFFFFF; // Matches no pixel once the alpha is masked out.
+        for (int y = 0; y < line->surface->h; y++) {
+            Uint32 *source = (Uint32*)((Uint8*)line->surface->pixels + y * line->surface->pitch), *target = (Uint32*)((Uint8*)pixels + y * pitch);
+            for (int x = 0; x < line->surface->w; x++) target[x] = (source[x] & 0x00FFFFFF) == key ? 0 : source[x] | 0xFF000000;
+        }
+        SDL_UnlockTexture(line->texture);
+        line->uploaded = true;
     }
+    return line->texture;
+}
+
+void free_text_line(TextLine *line) {
+    SDL_FreeSurface(line->surface);
+    if (line->texture != NULL) SDL_DestroyTexture(line->texture);
+    *line = {};
 }
 
 
+
 void DrawSurface(SDL_Surface *screen, SDL_Surface *sprite, int x, int y) {
 	SDL_Rect dest;
 	dest.x = x - sprite->w / 2;
@@ -58,87 +456,1793 @@ void DrawSurface(SDL_Surface *screen, SDL_Surface *sprite, int x, int y) {
 }
 
 
-void DrawPixel(SDL_Surface *surface, double x, double y, Uint32 color) {
-    if (x < SCREEN_WIDTH && x >= 0 && y < SCREEN_HEIGHT && y >= 0) {
-        int bpp = surface->format->BytesPerPixel;
-        Uint8 *p = (Uint8 *)surface->pixels + (int)y * surface->pitch + (int)x * bpp;
-        *(Uint32 *)p = color;
-	}
+// All the game's sprites packed side by side into a single texture that is uploaded once at startup.
+// Sprites are then drawn by picking their frame out of it with a source rectangle, so no textures are created while the game runs.
+struct SpriteAtlas {
+    SDL_Surface *sprites[MAX_ATLAS_FRAMES]; // Added sprites, only needed until build_sprite_atlas().
+    SDL_Rect frames[MAX_ATLAS_FRAMES]; // Where each sprite ended up within the texture.
+    int frames_count;
+    TextureHandle texture;
+};
+
+// Queue a sprite for the atlas and return its frame number, or -1 if the atlas is full.
+int add_to_atlas(SpriteAtlas *atlas, SDL_Surface *sprite) {
+    if (atlas->frames_count == MAX_ATLAS_FRAMES || sprite == NULL) return -1;
+    atlas->sprites[atlas->frames_count] = sprite;
+    return atlas->frames_count++;
+}
+
+// Pack the queued sprites into one ARGB surface and upload it. Pixels are copied as they are (no blending), so each frame looks
+// exactly like a texture created from its own surface would. Every frame gets a 1 pixel border repeating its edge pixels, so that
+// linear filtering of scaled sprites never picks up pixels of the neighbouring frame.
+bool build_sprite_atlas(SpriteAtlas *atlas, SDL_Renderer *renderer) {
+    int width = 0, height = 1;
+    for (int i = 0; i < atlas->frames_count; i++) {
+        atlas->frames[i] = {width + 1, 1, atlas->sprites[i]->w, atlas->sprites[i]->h};
+        width += atlas->sprites[i]->w + 2;
+        if (atlas->sprites[i]->h + 2 > height) height = atlas->sprites[i]->h + 2;
+    }
+    SDL_Surface *packed = SDL_CreateRGBSurface(0, width > 0 ? width : 1, height, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    if (packed == NULL) return false;
+    for (int i = 0; i < atlas->frames_count; i++) {
+        SDL_Surface *converted = SDL_ConvertSurfaceFormat(atlas->sprites[i], SDL_PIXELFORMAT_ARGB8888, 0);
+        if (converted == NULL) {
+            SDL_FreeSurface(packed);
+            return false;
+        }
+        for (int row = -1; row <= converted->h; row++) {
+            int source_row = row < 0 ? 0 : (row == converted->h ? converted->h - 1 : row); // Border rows repeat the first and last row.
+            Uint32 *source = (Uint32*)((Uint8*)converted->pixels + source_row * converted->pitch);
+            Uint32 *target = (Uint32*)((Uint8*)packed->pixels + (atlas->frames[i].y + row) * packed->pitch) + atlas->frames[i].x;
+            memcpy(target, source, converted->w * 4);
+            target[-1] = source[0];
+            target[converted->w] = source[converted->w - 1];
+        }
+        SDL_FreeSurface(converted);
+    }
+    atlas->texture = TextureHandle(SDL_CreateTextureFromSurface(renderer, packed));
+    SDL_FreeSurface(packed);
+    return atlas->texture != NULL;
+}
+
+
+// Quads collected over a frame and sent to the renderer with a single SDL_RenderGeometry() call per texture, instead of
+// drawing everything into the screen surface and uploading the whole surface every frame.
+struct GeometryBatch {
+    SDL_Renderer *renderer;
+    SDL_Texture *texture; // Texture of the quads currently in the batch, NULL for plain colored ones.
+    SDL_Vertex *vertices; // 4 per quad.
+    int *indices; // 6 per quad, two triangles. Always the same, so they're filled in once.
+    int quads_count;
+};
+
+void init_geometry_batch(GeometryBatch *batch, SDL_Renderer *renderer) {
+    batch->renderer = renderer;
+    batch->texture = NULL;
+    batch->quads_count = 0;
+    batch->vertices = (SDL_Vertex*)SDL_malloc(GEOMETRY_BATCH_QUADS * 4 * sizeof(SDL_Vertex));
+    batch->indices = (int*)SDL_malloc(GEOMETRY_BATCH_QUADS * 6 * sizeof(int));
+    for (int q = 0; q < GEOMETRY_BATCH_QUADS; q++) {
+        int corners[6] = {0, 1, 2, 2, 1, 3}; // Top left, top right, bottom left, then bottom left, top right, bottom right.
+        for (int i = 0; i < 6; i++) batch->indices[q * 6 + i] = q * 4 + corners[i];
+    }
+}
+
+void free_geometry_batch(GeometryBatch *batch) {
+    SDL_free(batch->vertices);
+    SDL_free(batch->indices);
+}
+
+// send everything queued so far to the renderer
+void FlushGeometry(GeometryBatch *batch) {
+    if (batch->quads_count == 0) return;
+    if (SDL_RenderGeometry(batch->renderer, batch->texture, batch->vertices, batch->quads_count * 4, batch->indices, batch->quads_count * 6) != 0) SDL_Log(SDL_GetError());
+    batch->quads_count = 0;
+}
+
+// queue a w by h quad at (x, y), showing the texture region (u0, v0) - (u1, v1) when the texture isn't NULL
+void BatchQuad(GeometryBatch *batch, SDL_Texture *texture, int x, int y, int w, int h, SDL_Color color, float u0, float v0, float u1, float v1) {
+    if (w <= 0 || h <= 0) return;
+    if (texture != batch->texture || batch->quads_count == GEOMETRY_BATCH_QUADS) {
+        FlushGeometry(batch);
+        batch->texture = texture;
+    }
+    SDL_Vertex *v = batch->vertices + batch->quads_count * 4;
+    v[0] = {{(float)x, (float)y}, color, {u0, v0}};
+    v[1] = {{(float)(x + w), (float)y}, color, {u1, v0}};
+    v[2] = {{(float)x, (float)(y + h)}, color, {u0, v1}};
+    v[3] = {{(float)(x + w), (float)(y + h)}, color, {u1, v1}};
+    batch->quads_count++;
+}
+
+// queue a rectangle of size l by k, looking like DrawRectangle() would draw it
+void BatchRectangle(GeometryBatch *batch, int x, int y, int l, int k, SDL_Color outlineColor, SDL_Color fillColor) {
+    BatchQuad(batch, NULL, x, y, l, k, outlineColor, 0, 0, 0, 0);
+    BatchQuad(batch, NULL, x + 1, y + 1, l - 2, k - 2, fillColor, 0, 0, 0, 0);
+}
+
+// queue a pre-rendered line of text starting from the point (x, y), looking like DrawTextLine() would draw it
+void BatchTextLine(GeometryBatch *batch, int x, int y, TextLine *line) {
+    SDL_Color white = {0xFF, 0xFF, 0xFF, 0xFF};
+    BatchQuad(batch, text_line_texture(batch->renderer, line), x, y, line->width, 8, white, 0, 0, (float)line->width / line->surface->w, 1);
+}
+
+// the renderer's equivalent of a color mapped for the given surface format
+SDL_Color ColorOf(Uint32 color, SDL_PixelFormat *format) {
+    SDL_Color rgba = {0, 0, 0, 0xFF};
+    SDL_GetRGB(color, format, &rgba.r, &rgba.g, &rgba.b);
+    return rgba;
+}
+
+
+// fill a horizontal span of n pixels starting at p, one specialization per pixel size
+template <int BytesPerPixel> void FillSpan(Uint8 *p, int n, Uint32 color);
+
+template <> inline void FillSpan<1>(Uint8 *p, int n, Uint32 color) {
+    memset(p, (Uint8)color, n);
+}
+
+template <> inline void FillSpan<2>(Uint8 *p, int n, Uint32 color) {
+    Uint16 *q = (Uint16 *)p;
+    for (int i = 0; i < n; i++) q[i] = (Uint16)color; // Plain store loop, vectorized by the compiler.
+}
+
+template <> inline void FillSpan<3>(Uint8 *p, int n, Uint32 color) {
+    Uint8 bytes[3];
+    memcpy(bytes, &color, 3); // The pixel's 3 bytes in memory order, whatever the byte order of the machine.
+    for (int i = 0; i < n; i++, p += 3) {
+        p[0] = bytes[0];
+        p[1] = bytes[1];
+        p[2] = bytes[2];
+    }
+}
+
+template <> inline void FillSpan<4>(Uint8 *p, int n, Uint32 color) {
+    SDL_memset4(p, color, n); // 32-bit fill, SDL picks the fastest one for the platform.
+}
+
+// fill the l by k rectangle at (x, y), clipped once to the surface's clip rectangle and then written span by span
+template <int BytesPerPixel> void FillRectangleSpans(SDL_Surface *screen, int x, int y, int l, int k, Uint32 color) {
+    const SDL_Rect *clip = &screen->clip_rect;
+    int left = x > clip->x ? x : clip->x, top = y > clip->y ? y : clip->y;
+    int right = x + l < clip->x + clip->w ? x + l : clip->x + clip->w, bottom = y + k < clip->y + clip->h ? y + k : clip->y + clip->h;
+    if (left >= right || top >= bottom) return;
+    Uint8 *row = (Uint8 *)screen->pixels + top * screen->pitch + left * BytesPerPixel;
+    for (int i = top; i < bottom; i++, row += screen->pitch) FillSpan<BytesPerPixel>(row, right - left, color);
+}
+
+// draw the four sides and then the inside, each one a clipped run of spans
+template <int BytesPerPixel> void DrawRectangleSpans(SDL_Surface *screen, int x, int y, int l, int k, Uint32 outlineColor, Uint32 fillColor) {
+    FillRectangleSpans<BytesPerPixel>(screen, x, y, 1, k, outlineColor); // Left side
+    FillRectangleSpans<BytesPerPixel>(screen, x + l - 1, y, 1, k, outlineColor); // Right side
+    FillRectangleSpans<BytesPerPixel>(screen, x, y, l, 1, outlineColor); // Top side
+    FillRectangleSpans<BytesPerPixel>(screen, x, y + k - 1, l, 1, outlineColor); // Bottom side
+    FillRectangleSpans<BytesPerPixel>(screen, x + 1, y + 1, l - 2, k - 2, fillColor); // Inside
+}
+
+// draw a rectangle of size l by k
+void DrawRectangle(SDL_Surface *screen, int x, int y, int l, int k, Uint32 outlineColor, Uint32 fillColor) {
+    switch (screen->format->BytesPerPixel) {
+        case 1: DrawRectangleSpans<1>(screen, x, y, l, k, outlineColor, fillColor); break;
+        case 2: DrawRectangleSpans<2>(screen, x, y, l, k, outlineColor, fillColor); break;
+        case 3: DrawRectangleSpans<3>(screen, x, y, l, k, outlineColor, fillColor); break;
+        default: DrawRectangleSpans<4>(screen, x, y, l, k, outlineColor, fillColor); break;
+    }
+}
+
+
+// Software drawing into the screen surface, recorded over a frame and then replayed by several threads at once: each one owns a horizontal
+// band of the surface and replays every command clipped to it. Bands don't overlap and each gets the commands in the recorded order, so the
+// result is the same, pixel for pixel, as drawing everything on a single thread.
+enum RasterCommandType {
+    RASTER_FILL, // SDL_FillRect()
+    RASTER_RECTANGLE, // DrawRectangle()
+    RASTER_BLIT, // SDL_BlitSurface()
+    RASTER_CLIP // SDL_SetClipRect() for the commands that follow.
+};
+
+struct RasterCommand {
+    int type;
+    SDL_Rect rect; // Target rectangle, in the coordinates of the whole target surface.
+    Uint32 outline_color, fill_color; // Fills only use the fill color.
+    SDL_Surface *surface; // Blits: the source surface and the part of it to copy, already clipped to the surface.
+    SDL_Rect source;
+    bool copy; // Blits of 32 bit pixels with the same colors, copied directly instead of through SDL_BlitSurface().
+    bool keyed; // Copies skipping the pixels of the color key.
+    Uint32 key, alpha; // The color key, and the alpha bits set on copied pixels that have no alpha of their own.
+};
+
+struct Rasterizer;
+
+struct RasterBand {
+    Rasterizer *rasterizer;
+    SDL_Surface *surface; // The band's rows of the target surface, sharing its pixels.
+    int top; // First row of the band within the target surface.
+    SDL_Thread *thread; // NULL for the first band, which the main thread replays itself.
+    SDL_sem *start;
+};
+
+struct Rasterizer {
+    SDL_Surface *target; // Usually the screen surface.
+    int origin_x, origin_y; // Added to the position of everything recorded, see set_raster_origin().
+    RasterCommand *commands;
+    int commands_count, commands_capacity;
+    RasterBand bands[RASTER_MAX_BANDS];
+    int bands_count;
+    SDL_sem *done; // Posted by every band thread once it's replayed the frame.
+    SDL_mutex *blit_lock; // SDL_BlitSurface() keeps state in the source surface, so blits into different bands can't run it concurrently.
+    bool quit;
+};
+
+RasterCommand* record_raster(Rasterizer *raster, int type) {
+    if (raster->commands_count == raster->commands_capacity) {
+        raster->commands_capacity = raster->commands_capacity > 0 ? raster->commands_capacity * 2 : 256;
+        raster->commands = (RasterCommand*)SDL_realloc(raster->commands, raster->commands_capacity * sizeof(RasterCommand));
+    }
+    RasterCommand *command = &raster->commands[raster->commands_count++];
+    memset(command, 0, sizeof(*command));
+    command->type = type;
+    return command;
+}
+
+// Move everything recorded from now on by (x, y), so that the same drawing code can draw into another part of the target.
+void set_raster_origin(Rasterizer *raster, int x, int y) {
+    raster->origin_x = x;
+    raster->origin_y = y;
+}
+
+// record limiting the commands that follow to rect (moved by the origin), or lifting the limit if NULL
+void RasterClip(Rasterizer *raster, const SDL_Rect *rect) {
+    RasterCommand *command = record_raster(raster, RASTER_CLIP);
+    if (rect != NULL) command->rect = {rect->x + raster->origin_x, rect->y + raster->origin_y, rect->w, rect->h};
+    else command->rect = {0, 0, raster->target->w, raster->target->h};
+}
+
+// record filling rect (the whole target if NULL) with color
+void RasterFill(Rasterizer *raster, const SDL_Rect *rect, Uint32 color) {
+    RasterCommand *command = record_raster(raster, RASTER_FILL);
+    if (rect != NULL) command->rect = {rect->x + raster->origin_x, rect->y + raster->origin_y, rect->w, rect->h};
+    else command->rect = {0, 0, raster->target->w, raster->target->h};
+    command->fill_color = color;
+}
+
+// record a rectangle of size l by k, drawn with DrawRectangle()
+void RasterRectangle(Rasterizer *raster, int x, int y, int l, int k, Uint32 outlineColor, Uint32 fillColor) {
+    RasterCommand *command = record_raster(raster, RASTER_RECTANGLE);
+    command->rect = {x + raster->origin_x, y + raster->origin_y, l, k};
+    command->outline_color = outlineColor;
+    command->fill_color = fillColor;
+}
+
+// record blitting the source part of surface (all of it if NULL) to the point (x, y), the same as SDL_BlitSurface() would
+void RasterBlit(Rasterizer *raster, SDL_Surface *surface, const SDL_Rect *source, int x, int y) {
+    SDL_PixelFormat *from = surface->format, *to = raster->target->format;
+    SDL_BlendMode blend;
+    RasterCommand *command = record_raster(raster, RASTER_BLIT);
+    command->surface = surface;
+    command->source = source != NULL ? *source : SDL_Rect{0, 0, surface->w, surface->h};
+    if (command->source.x < 0) { // Clip the source to the surface, moving the target along, as SDL_BlitSurface() does.
+        x -= command->source.x;
+        command->source.w += command->source.x;
+        command->source.x = 0;
+    }
+    if (command->source.y < 0) {
+        y -= command->source.y;
+        command->source.h += command->source.y;
+        command->source.y = 0;
+    }
+    command->source.w = SDL_min(command->source.w, surface->w - command->source.x);
+    command->source.h = SDL_min(command->source.h, surface->h - command->source.y);
+    command->rect = {x + raster->origin_x, y + raster->origin_y, command->source.w, command->source.h};
+    SDL_GetSurfaceBlendMode(surface, &blend);
+    command->keyed = SDL_GetColorKey(surface, &command->key) == 0;
+    command->copy = from->BytesPerPixel == 4 && to->BytesPerPixel == 4 && !SDL_MUSTLOCK(surface)
+        && from->Rmask == to->Rmask && from->Gmask == to->Gmask && from->Bmask == to->Bmask
+        && (from->Amask == 0 || (from->Amask == to->Amask && blend == SDL_BLENDMODE_NONE && !command->keyed)); // Pixels with alpha are only copied as they are.
+    command->alpha = from->Amask == 0 ? to->Amask : 0;
+}
+
+// copy the pixels of a blit that fall within the band's clip rectangle, exactly the way SDL's own 32 bit blits do it
+void CopyRasterPixels(RasterCommand *command, SDL_Surface *band, int top) {
+    SDL_Surface *surface = command->surface;
+    const SDL_Rect *clip = &band->clip_rect;
+    int left = SDL_max(command->rect.x, clip->x), right = SDL_min(command->rect.x + command->rect.w, clip->x + clip->w);
+    int first = SDL_max(command->rect.y - top, clip->y), last = SDL_min(command->rect.y + command->rect.h - top, clip->y + clip->h);
+    if (left >= right) return; // Entirely to the side of the clip rectangle.
+    Uint32 colors = surface->format->Rmask | surface->format->Gmask | surface->format->Bmask;
+    for (int row = first; row < last; row++) {
+        Uint32 *from = (Uint32*)((Uint8*)surface->pixels + (command->source.y + row + top - command->rect.y) * surface->pitch) + command->source.x + left - command->rect.x;
+        Uint32 *to = (Uint32*)((Uint8*)band->pixels + row * band->pitch) + left;
+        if (!command->keyed && command->alpha == 0) memcpy(to, from, (right - left) * 4);
+        else if (!command->keyed) for (int i = 0; i < right - left; i++) to[i] = from[i] | command->alpha;
+        else for (int i = 0; i < right - left; i++) if ((from[i] & colors) != command->key) to[i] = from[i] | command->alpha;
+    }
+}
+
+// replay the frame's commands into a single band
+// Pixels a command may touch, in the coordinates of the whole target. Mostly its rectangle, but DrawRectangle() draws the sides of degenerate
+// rectangles outside of theirs, e.g. the bottom side of a zero height one goes a row above its top side.
+SDL_Rect raster_command_bounds(RasterCommand *command) {
+    SDL_Rect bounds = command->rect;
+    if (command->type == RASTER_RECTANGLE) {
+        bounds.x = SDL_min(command->rect.x, command->rect.x + command->rect.w - 1);
+        bounds.y = SDL_min(command->rect.y, command->rect.y + command->rect.h - 1);
+        bounds.w = SDL_max(command->rect.x + 1, command->rect.x + command->rect.w) - bounds.x;
+        bounds.h = SDL_max(command->rect.y + 1, command->rect.y + command->rect.h) - bounds.y;
+    }
+    return bounds;
+}
+
+void replay_raster_band(Rasterizer *raster, RasterBand *band) {
+    for (int c = 0; c < raster->commands_count; c++) {
+        RasterCommand *command = &raster->commands[c];
+        SDL_Rect rect = {command->rect.x, command->rect.y - band->top, command->rect.w, command->rect.h};
+        if (command->type == RASTER_CLIP) {
+            if (!SDL_SetClipRect(band->surface, &rect)) band->surface->clip_rect = {0, 0, 0, 0}; // Nothing of the band left to draw into.
+            continue;
+        }
+        SDL_Rect bounds = raster_command_bounds(command);
+        if (bounds.y - band->top >= band->surface->h || bounds.y + bounds.h - band->top <= 0) continue; // Not within the band at all.
+        switch (command->type) {
+            case RASTER_FILL: SDL_FillRect(band->surface, &rect, command->fill_color); break;
+            case RASTER_RECTANGLE: DrawRectangle(band->surface, rect.x, rect.y, rect.w, rect.h, command->outline_color, command->fill_color); break;
+            case RASTER_BLIT:
+                if (command->copy) CopyRasterPixels(command, band->surface, band->top);
+                else {
+                    SDL_LockMutex(raster->blit_lock);
+                    SDL_BlitSurface(command->surface, &command->source, band->surface, &rect);
+                    SDL_UnlockMutex(raster->blit_lock);
+                }
+                break;
+        }
+    }
+    SDL_SetClipRect(band->surface, NULL);
+}
+
+int raster_band_thread(void *data) {
+    RasterBand *band = (RasterBand*)data;
+    while (true) {
+        SDL_SemWait(band->start);
+        if (band->rasterizer->quit) return 0;
+        replay_raster_band(band->rasterizer, band);
+        SDL_SemPost(band->rasterizer->done);
+    }
+}
+
+// Split the target surface into bands_count bands (0 = one per core) and start a thread for each band but the first one.
+void init_rasterizer(Rasterizer *raster, SDL_Surface *target, int bands_count) {
+    char name[32];
+    memset(raster, 0, sizeof(*raster));
+    raster->target = target;
+    raster->bands_count = SDL_max(1, SDL_min(SDL_min(bands_count > 0 ? bands_count : SDL_GetCPUCount(), RASTER_MAX_BANDS), target->h));
+    raster->done = SDL_CreateSemaphore(0);
+    raster->blit_lock = SDL_CreateMutex();
+    for (int b = 0; b < raster->bands_count; b++) {
+        RasterBand *band = &raster->bands[b];
+        int bottom = target->h * (b + 1) / raster->bands_count;
+        band->rasterizer = raster;
+        band->top = target->h * b / raster->bands_count;
+        band->surface = SDL_CreateRGBSurfaceFrom((Uint8*)target->pixels + band->top * target->pitch, target->w, bottom - band->top, target->format->BitsPerPixel,
+            target->pitch, target->format->Rmask, target->format->Gmask, target->format->Bmask, target->format->Amask);
+        if (b == 0) continue;
+        band->start = SDL_CreateSemaphore(0);
+        sprintf(name, "raster band %d", b);
+        band->thread = SDL_CreateThread(raster_band_thread, name, band);
+    }
+}
+
+// Replay the commands recorded since the last call into the target surface, all bands at once, and start recording the next frame.
+void Rasterize(Rasterizer *raster) {
+    for (int b = 1; b < raster->bands_count; b++) SDL_SemPost(raster->bands[b].start);
+    replay_raster_band(raster, &raster->bands[0]);
+    for (int b = 1; b < raster->bands_count; b++) SDL_SemWait(raster->done);
+    raster->commands_count = 0;
+}
+
+void free_rasterizer(Rasterizer *raster) {
+    raster->quit = true;
+    for (int b = 0; b < raster->bands_count; b++) {
+        RasterBand *band = &raster->bands[b];
+        if (band->thread != NULL) {
+            SDL_SemPost(band->start);
+            SDL_WaitThread(band->thread, NULL);
+            SDL_DestroySemaphore(band->start);
+        }
+        SDL_FreeSurface(band->surface);
+    }
+    SDL_DestroySemaphore(raster->done);
+    SDL_DestroyMutex(raster->blit_lock);
+    SDL_free(raster->commands);
+}
+
+// record drawing a pre-rendered line of text, starting from the point (x, y)
+void DrawTextLine(Rasterizer *raster, int x, int y, TextLine *line) {
+	SDL_Rect source = {0, 0, line->width, 8};
+	RasterBlit(raster, line->surface, &source, x, y);
+}
+
+
+// Uniform grid over the looping map used to find the platforms near a given stretch of it without scanning the whole map.
+// Bucket b covers map x coordinates [b * bucket_width, (b + 1) * bucket_width) and lists every platform whose horizontal span touches it.
+struct MapIndex {
+    int bucket_count, elements_count;
+    double bucket_width;
+    int *bucket_start; // bucket_count + 1 offsets into entries; bucket b's platforms are entries[bucket_start[b]] .. entries[bucket_start[b+1] - 1].
+    int *entries; // Platform indices, ascending within each bucket.
+    double (*elements)[4]; // The indexed platforms.
+};
+
+// Range of buckets touched by the platform's span [x, x + width], clamped to the start of the map. A span running past the end of the map
+// gives a last bucket past bucket_count - 1: the platform also covers buckets 0, 1, ... of the next lap, where queries that have wrapped
+// around look for it. Callers take the buckets modulo bucket_count. Platforms starting past the end of the map end up in the last bucket.
+void index_bucket_range(MapIndex *index, double *element, int *first, int *last) {
+    *first = (int)floor(element[0] / index->bucket_width);
+    *last = (int)floor((element[0] + element[2]) / index->bucket_width);
+    if (*first < 0) *first = 0;
+    if (*last < *first) *last = *first; // Platforms lying entirely before the map still end up in the nearest bucket.
+    if (*first >= index->bucket_count) *first = *last = index->bucket_count - 1;
+    if (*last - *first >= index->bucket_count) *last = *first + index->bucket_count - 1; // Every bucket, once.
+}
+
+// Build the index once after the map has been loaded. Two passes: count the entries per bucket, then fill them in platform order.
+void build_map_index(MapIndex *index, double map_length, int map_elements_count, double (*map_elements)[4]) {
+    int first, last;
+    index->bucket_count = (int)ceil(map_length / INDEX_BUCKET_WIDTH);
+    if (index->bucket_count < 1) index->bucket_count = 1;
+    index->bucket_width = map_length > 0 ? map_length / index->bucket_count : INDEX_BUCKET_WIDTH; // Buckets must tile the map exactly for the wraparound to line up.
+    index->elements_count = map_elements_count;
+    index->elements = map_elements;
+    index->bucket_start = (int*)SDL_calloc(index->bucket_count + 1, sizeof(int));
+
+    for (int i = 0; i < map_elements_count; i++) {
+        index_bucket_range(index, map_elements[i], &first, &last);
+        for (int b = first; b <= last; b++) index->bucket_start[b % index->bucket_count + 1]++;
+    }
+    for (int b = 0; b < index->bucket_count; b++) index->bucket_start[b + 1] += index->bucket_start[b]; // Counts to offsets.
+
+    int *fill = (int*)SDL_malloc(index->bucket_count * sizeof(int)); // Next free slot in each bucket.
+    memcpy(fill, index->bucket_start, index->bucket_count * sizeof(int));
+    index->entries = (int*)SDL_malloc((index->bucket_start[index->bucket_count] > 0 ? index->bucket_start[index->bucket_count] : 1) * sizeof(int));
+    for (int i = 0; i < map_elements_count; i++) {
+        index_bucket_range(index, map_elements[i], &first, &last);
+        for (int b = first; b <= last; b++) index->entries[fill[b % index->bucket_count]++] = i;
+    }
+    SDL_free(fill);
+}
+
+// Find the platforms whose span may overlap the map stretch [from, to]. The stretch may run past the end of the map, in which case it continues
+// from the beginning, the same way the map loops. Results are written to out in ascending platform order (the order the full scans used to visit them),
+// and the number of results is returned. The caller still performs its exact tests, the index only narrows down the candidates.
+// Queries don't modify the index, so any number of threads may run them at once.
+int query_map_index(MapIndex *index, double from, double to, double **out, int capacity) {
+    int count = 0, first_bucket, bucket_span, unique = 0;
+    first_bucket = (int)floor(from / index->bucket_width);
+    bucket_span = (int)floor(to / index->bucket_width) - first_bucket + 1;
+    if (bucket_span > index->bucket_count) bucket_span = index->bucket_count; // The stretch covers the whole map anyway.
+
+    for (int j = 0; j < bucket_span; j++) {
+        int b = ((first_bucket + j) % index->bucket_count + index->bucket_count) % index->bucket_count; // Wrap around the looping map.
+        for (int e = index->bucket_start[b]; e < index->bucket_start[b + 1]; e++) {
+            if (count == capacity) {
+                SDL_Log("Too many platforms in a single map index query! Only the first %d are used.", capacity);
+                bucket_span = 0;
+                break;
+            }
+            out[count++] = index->elements[index->entries[e]];
+        }
+    }
+
+    for (int k = 1; k < count; k++) { // Insertion sort by address, which is platform order; there are only ever a handful of results.
+        double *element = out[k];
+        int l = k - 1;
+        while (l >= 0 && out[l] > element) {
+            out[l + 1] = out[l];
+            l--;
+        }
+        out[l + 1] = element;
+    }
+    for (int k = 0; k < count; k++) { // Platforms spanning several buckets were reported once per bucket; after sorting their copies are adjacent.
+        if (unique == 0 || out[unique - 1] != out[k]) out[unique++] = out[k];
+    }
+    return unique;
+}
+
+void free_map_index(MapIndex *index) {
+    SDL_free(index->bucket_start);
+    SDL_free(index->entries);
+}
+
+struct MapStream;
+
+// A loaded map. Platforms are stored as one contiguous array of rows of 4 numbers: x, y, width and height.
+// Depending on where the map came from, the rows either live in a single malloc'd block or point straight into a memory-mapped compiled map file.
+struct Map {
+    double length, height;
+    int elements_count;
+    double (*elements)[4]; // NULL for streamed maps, which only ever hold a few chunks in memory.
+    void *mapping; // Start of the memory-mapped compiled file, NULL for maps parsed from text.
+    size_t mapping_size;
+    MapIndex index; // Built with build_map_index() for maps held in memory as a whole.
+    MapStream *stream; // Non-NULL for maps streamed chunk by chunk, see open_map_stream().
+};
+
+// Header of a compiled map file, in the machine's native byte order. It is followed by the chunk table, chunks_count + 1 Uint32s where
+// chunk c holds platforms chunk_table[c] .. chunk_table[c+1] - 1, and then at elements_offset by elements_count rows of 4 doubles sorted by x.
+// Chunk c holds the platforms starting within [c * chunk_width, (c + 1) * chunk_width).
+struct MapFileHeader {
+    char magic[8]; // MAP_FILE_MAGIC, zero-padded.
+    Uint32 version; // MAP_FILE_VERSION
+    Uint32 elements_count;
+    double length, height;
+    double chunk_width;
+    double max_element_width; // Widest platform, i.e. how far to the right a chunk's platforms can reach past its start.
+    Uint32 chunks_count;
+    Uint32 elements_offset; // Byte offset of the platform rows from the start of the file, a multiple of 8.
+};
+
+// Parse the text map, the source of truth for map files. All platforms go into a single allocation.
+void load_map_text(const char *path, Map *map) {
+    int length, height, number_of_segments, fscanf_status;
+    double (*data)[4];
+    FILE *fptr;
+    fptr = fopen(path, "r");
+    if (fptr == NULL) {
+        SDL_Log("Error reading the map file! Cannot open %s!", path);
+        exit(1);
+    }
+    fscanf(fptr, "%d %d", &length, &height);
+    fscanf(fptr, "%d", &number_of_segments);
+    data = (double(*)[4])SDL_malloc((number_of_segments > 0 ? number_of_segments : 1) * sizeof(*data));
+    for (int i = 0; i < number_of_segments; i++) {
+        fscanf_status = fscanf(fptr, "%lf %lf %lf %lf", &data[i][0], &data[i][1], &data[i][2], &data[i][3]);
+        if (fscanf_status != 4) { // We use the number of matches fscanf() returns to make sure we read exactly 4 number in each line.
+            SDL_Log("Error reading the map file! Incorrect data in line %d!", i+3);
+            fclose(fptr);
+            exit(1);
+        }
+    }
+
+    fgetc(fptr); // as scanf() leaves endlines in the buffer, we need to get rid of the end of the last line containing data
+    if (!((fgetc(fptr) == '\n') || feof(fptr))) { // Now we check if the file ends either with an empty line or just after the end of the last line of data.
+        SDL_Log("Error reading the map file! The file contains more lines than declared!"); // If there is anything besides that at the end of the file, we raise alarm.
+        fclose(fptr);
+        exit(1);
+    }
+    fclose(fptr);
+    map->length = length;
+    map->height = height;
+    map->elements_count = number_of_segments;
+    map->elements = data;
+    map->mapping = NULL;
+    map->mapping_size = 0;
+    map->stream = NULL;
+}
+
+// Map a compiled map file into memory and point the map straight at its platform array. No parsing and no per-platform allocation.
+void load_map_binary(const char *path, Map *map) {
+    MapFileHeader *header;
+    size_t size;
+#ifndef _WIN32
+    struct stat file_info;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_info) != 0) {
+        SDL_Log("Error reading the map file! Cannot open %s!", path);
+        exit(1);
+    }
+    size = file_info.st_size;
+    void *mapping = size >= sizeof(MapFileHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd); // The mapping stays valid after the descriptor is closed.
+    if (mapping == MAP_FAILED) {
+        SDL_Log("Error reading the map file! %s is not a valid compiled map!", path);
+        exit(1);
+    }
+#else // No mmap() here, so read the whole file into a single block instead. Still no parsing.
+    SDL_RWops *file = SDL_RWFromFile(path, "rb");
+    if (file == NULL) {
+        SDL_Log("Error reading the map file! Cannot open %s!", path);
+        exit(1);
+    }
+    size = SDL_RWsize(file);
+    void *mapping = SDL_malloc(size);
+    if (size < sizeof(MapFileHeader) || SDL_RWread(file, mapping, size, 1) != 1) {
+        SDL_Log("Error reading the map file! %s is not a valid compiled map!", path);
+        SDL_RWclose(file);
+        exit(1);
+    }
+    SDL_RWclose(file);
+#endif
+    header = (MapFileHeader*)mapping;
+    if (strncmp(header->magic, MAP_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != MAP_FILE_VERSION) {
+        SDL_Log("Error reading the map file! %s was compiled by an incompatible version of the game, recompile it!", path);
+        exit(1);
+    }
+    if (header->elements_offset < sizeof(MapFileHeader) + (header->chunks_count + 1) * sizeof(Uint32)
+    || size != header->elements_offset + (size_t)header->elements_count * sizeof(*map->elements)
+    ) {
+        SDL_Log("Error reading the map file! %s is truncated or contains more data than declared!", path);
+        exit(1);
+    }
+    map->length = header->length;
+    map->height = header->height;
+    map->elements_count = header->elements_count;
+    map->elements = (double(*)[4])((char*)mapping + header->elements_offset);
+    map->mapping = mapping;
+    map->mapping_size = size;
+    map->stream = NULL;
+}
+
+// Load a map from either a text or a compiled file, whichever the file turns out to be.
+void load_map(const char *path, Map *map) {
+    char magic[sizeof(((MapFileHeader*)NULL)->magic)] = {0};
+    FILE *fptr = fopen(path, "rb");
+    if (fptr != NULL) {
+        fread(magic, 1, sizeof(magic), fptr);
+        fclose(fptr);
+    }
+    if (strncmp(magic, MAP_FILE_MAGIC, sizeof(magic)) == 0) load_map_binary(path, map);
+    else load_map_text(path, map);
+}
+
+// States of a chunk slot. The main loop owns FREE, READY and RESIDENT slots, the loader thread owns REQUESTED and LOADING ones.
+// Each side only ever hands a slot over to the other by an atomic store, so neither ever waits for the other.
+enum ChunkSlotState {
+    SLOT_FREE, // Unused, may be handed out for a new chunk.
+    SLOT_REQUESTED, // Main loop wants chunk loaded into it.
+    SLOT_LOADING, // Loader thread is reading the chunk from disk.
+    SLOT_READY, // Loaded, waiting for the main loop to pick it up.
+    SLOT_RESIDENT // Visible to collision detection and drawing.
+};
+
+struct ChunkSlot {
+    SDL_atomic_t state;
+    int chunk, elements_count;
+    double (*elements)[4]; // Room for the largest chunk of the map.
+};
+
+// A compiled map streamed from disk a few chunks at a time, ahead of map_offset, and evicted once it's behind.
+// Endless maps are streamed the same way, except that the loader thread generates the chunks instead of reading them, see open_endless_stream().
+struct MapStream {
+    SDL_RWops *file; // Only ever touched by the loader thread after opening. NULL for endless maps.
+    Uint32 *chunk_table;
+    int chunks_count, slots_count;
+    double length, chunk_width, max_element_width;
+    Uint32 elements_offset;
+    ChunkSlot *slots;
+    SDL_sem *requests; // Posted by the main loop for every chunk it requests. Posting never blocks.
+    SDL_atomic_t quit;
+    SDL_Thread *loader;
+    // Endless maps only.
+    Uint32 seed;
+    int unicorn_width, unicorn_height; // Size of the unicorn the platforms have to be reachable for.
+    double highest, lowest; // Range of platform heights (top y) the generator keeps to.
+    int chunk_capacity; // Max number of platforms in a generated chunk.
+};
+
+void generate_chunk(MapStream *stream, ChunkSlot *slot);
+
+int map_stream_loader(void *data) {
+    MapStream *stream = (MapStream*)data;
+    while (true) {
+        SDL_SemWait(stream->requests);
+        if (SDL_AtomicGet(&stream->quit)) return 0;
+        for (int s = 0; s < stream->slots_count; s++) {
+            ChunkSlot *slot = &stream->slots[s];
+            if (!SDL_AtomicCAS(&slot->state, SLOT_REQUESTED, SLOT_LOADING)) continue;
+            if (stream->file == NULL) {
+                generate_chunk(stream, slot);
+                SDL_AtomicSet(&slot->state, SLOT_READY);
+                continue;
+            }
+            int first = stream->chunk_table[slot->chunk], count = stream->chunk_table[slot->chunk + 1] - first;
+            SDL_RWseek(stream->file, stream->elements_offset + (Sint64)first * sizeof(*slot->elements), RW_SEEK_SET);
+            if ((int)SDL_RWread(stream->file, slot->elements, sizeof(*slot->elements), count) != count) {
+                SDL_Log("Error streaming the map! Cannot read chunk %d.", slot->chunk);
+                count = 0;
+            }
+            slot->elements_count = count;
+            SDL_AtomicSet(&slot->state, SLOT_READY); // Publishes the rows written above.
+        }
+    }
+}
+
+// Whether the (wrapped) chunk lies within the unwrapped chunk range [first, last].
+bool map_stream_wants(MapStream *stream, int chunk, int first, int last) {
+    if (last - first + 1 >= stream->chunks_count) return true;
+    return ((chunk - first) % stream->chunks_count + stream->chunks_count) % stream->chunks_count <= last - first;
+}
+
+// Range of unwrapped chunks that have to be resident around map_offset: from the last chunk whose platforms may still reach the screen,
+// up to MAP_STREAM_CHUNKS_AHEAD chunks past its right edge.
+void map_stream_window(MapStream *stream, double map_offset, int *first, int *last) {
+    *first = (int)floor((map_offset - stream->max_element_width - 1) / stream->chunk_width);
+    *last = (int)floor((map_offset + SCREEN_WIDTH + 1) / stream->chunk_width) + MAP_STREAM_CHUNKS_AHEAD;
+}
+
+// Called by the main loop every tick: picks up finished chunks, evicts the ones behind and requests the ones ahead. Never blocks.
+void update_map_stream(MapStream *stream, double map_offset) {
+    int first, last;
+    map_stream_window(stream, map_offset, &first, &last);
+
+    for (int s = 0; s < stream->slots_count; s++) {
+        ChunkSlot *slot = &stream->slots[s];
+        int state = SDL_AtomicGet(&slot->state);
+        if (state == SLOT_READY || state == SLOT_RESIDENT) {
+            if (map_stream_wants(stream, slot->chunk, first, last)) SDL_AtomicSet(&slot->state, SLOT_RESIDENT);
+            else SDL_AtomicSet(&slot->state, SLOT_FREE);
+        }
+    }
+
+    for (int c = first; c <= last && c - first < stream->chunks_count; c++) {
+        int chunk = (c % stream->chunks_count + stream->chunks_count) % stream->chunks_count, free_slot = -1;
+        bool present = false;
+        for (int s = 0; s < stream->slots_count && !present; s++) {
+            if (SDL_AtomicGet(&stream->slots[s].state) == SLOT_FREE) {
+                if (free_slot < 0) free_slot = s;
+            } else if (stream->slots[s].chunk == chunk) present = true;
+        }
+        if (present) continue;
+        if (free_slot < 0) break; // All slots busy, e.g. with chunks that are still loading but no longer needed. Try again next tick.
+        stream->slots[free_slot].chunk = chunk;
+        SDL_AtomicSet(&stream->slots[free_slot].state, SLOT_REQUESTED);
+        SDL_SemPost(stream->requests);
+    }
+}
+
+// Allocate the chunk slots, start the loader thread and load the chunks around map_offset 0. Shared by compiled and endless maps.
+void start_map_stream(MapStream *stream, int largest_chunk, double height, int elements_count, Map *map) {
+    int first, last;
+    map_stream_window(stream, 0, &first, &last);
+    stream->slots_count = last - first + 1 + MAP_STREAM_CHUNKS_AHEAD; // The window, plus some spare slots for loads that outlive it.
+    stream->slots = (ChunkSlot*)SDL_calloc(stream->slots_count, sizeof(ChunkSlot));
+    for (int s = 0; s < stream->slots_count; s++) {
+        SDL_AtomicSet(&stream->slots[s].state, SLOT_FREE);
+        stream->slots[s].elements = (double(*)[4])SDL_malloc(largest_chunk * sizeof(*stream->slots[s].elements));
+    }
+    stream->requests = SDL_CreateSemaphore(0);
+    stream->loader = SDL_CreateThread(map_stream_loader, "map stream loader", stream);
+
+    map->length = stream->length;
+    map->height = height;
+    map->elements_count = elements_count;
+    map->elements = NULL;
+    map->mapping = NULL;
+    map->mapping_size = 0;
+    map->stream = stream;
+
+    update_map_stream(stream, 0);
+    for (int s = 0; s < stream->slots_count; s++) { // Startup is the one place where waiting for the disk is fine.
+        while (SDL_AtomicGet(&stream->slots[s].state) == SLOT_REQUESTED || SDL_AtomicGet(&stream->slots[s].state) == SLOT_LOADING) SDL_Delay(1);
+    }
+    update_map_stream(stream, 0);
+}
+
+// Open a compiled map for streaming. Only the header and the chunk table are read up front. The chunks around map_offset 0 are loaded
+// before returning, so the first frame already has them.
+void open_map_stream(const char *path, Map *map) {
+    MapFileHeader header;
+    MapStream *stream = (MapStream*)SDL_calloc(1, sizeof(MapStream));
+    stream->file = SDL_RWFromFile(path, "rb");
+    if (stream->file == NULL) {
+        SDL_Log("Error reading the map file! Cannot open %s!", path);
+        exit(1);
+    }
+    if (SDL_RWread(stream->file, &header, sizeof(header), 1) != 1 || strncmp(header.magic, MAP_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        SDL_Log("Error reading the map file! Only compiled maps can be streamed, compile %s with --compile-map first!", path);
+        exit(1);
+    }
+    if (header.version != MAP_FILE_VERSION) {
+        SDL_Log("Error reading the map file! %s was compiled by an incompatible version of the game, recompile it!", path);
+        exit(1);
+    }
+    stream->chunks_count = header.chunks_count;
+    stream->length = header.length;
+    stream->chunk_width = header.chunk_width;
+    stream->max_element_width = header.max_element_width;
+    stream->elements_offset = header.elements_offset;
+    stream->chunk_table = (Uint32*)SDL_malloc((header.chunks_count + 1) * sizeof(Uint32));
+    if (SDL_RWread(stream->file, stream->chunk_table, sizeof(Uint32), header.chunks_count + 1) != header.chunks_count + 1) {
+        SDL_Log("Error reading the map file! %s is truncated!", path);
+        exit(1);
+    }
+
+    int largest_chunk = 1;
+    for (int c = 0; c < stream->chunks_count; c++) {
+        int count = stream->chunk_table[c + 1] - stream->chunk_table[c];
+        if (count > largest_chunk) largest_chunk = count;
+    }
+    start_map_stream(stream, largest_chunk, header.height, header.elements_count, map);
+}
+
+void close_map_stream(MapStream *stream) {
+    SDL_AtomicSet(&stream->quit, 1);
+    SDL_SemPost(stream->requests);
+    SDL_WaitThread(stream->loader, NULL);
+    SDL_DestroySemaphore(stream->requests);
+    if (stream->file != NULL) SDL_RWclose(stream->file);
+    for (int s = 0; s < stream->slots_count; s++) SDL_free(stream->slots[s].elements);
+    SDL_free(stream->slots);
+    SDL_free(stream->chunk_table);
+    SDL_free(stream);
+}
+
+// Resident platforms whose span may overlap the map stretch [from, to], in chunk order. Chunks that haven't arrived yet are simply skipped.
+int query_map_stream(MapStream *stream, double from, double to, double **out, int capacity) {
+    int count = 0, first = (int)floor((from - stream->max_element_width) / stream->chunk_width), last = (int)floor(to / stream->chunk_width);
+    for (int c = first; c <= last && c - first < stream->chunks_count; c++) {
+        int chunk = (c % stream->chunks_count + stream->chunks_count) % stream->chunks_count;
+        double shift = (c - chunk) / stream->chunks_count * stream->length; // Map coordinates of this lap of the loop.
+        for (int s = 0; s < stream->slots_count; s++) {
+            ChunkSlot *slot = &stream->slots[s];
+            if (slot->chunk != chunk || SDL_AtomicGet(&slot->state) != SLOT_RESIDENT) continue;
+            for (int i = 0; i < slot->elements_count; i++) {
+                if (slot->elements[i][0] + shift > to || slot->elements[i][0] + slot->elements[i][2] + shift < from) continue;
+                if (count == capacity) {
+                    SDL_Log("Too many platforms in a single map query! Only the first %d are used.", capacity);
+                    return count;
+                }
+                out[count++] = slot->elements[i];
+            }
+        }
+    }
+    return count;
+}
+
+void free_map(Map *map) {
+    if (map->stream != NULL) close_map_stream(map->stream);
+    else if (map->mapping == NULL) SDL_free(map->elements);
+#ifndef _WIN32
+    else munmap(map->mapping, map->mapping_size);
+#else
+    else SDL_free(map->mapping);
+#endif
+}
+
+// Chunk a platform starting at x belongs to, clamped to the map.
+int map_chunk_of(double x, double chunk_width, int chunks_count) {
+    int chunk = (int)floor(x / chunk_width);
+    if (chunk < 0) return 0;
+    if (chunk >= chunks_count) return chunks_count - 1;
+    return chunk;
+}
+
+// qsort() comparator ordering platforms by x. Ties are broken by position in the text file, so that the order is stable.
+int compare_elements_by_x(const void *a, const void *b) {
+    const double *first = *(const double**)a, *second = *(const double**)b;
+    if (first[0] != second[0]) return first[0] < second[0] ? -1 : 1;
+    return first < second ? -1 : first > second;
+}
+
+// Offline step: validate a text map and write it out as a compiled map file the game can load without parsing or stream chunk by chunk.
+int compile_map(const char *text_path, const char *binary_path) {
+    Map map;
+    MapFileHeader header;
+    load_map_text(text_path, &map); // Exits with the usual errors if the text map is invalid.
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, MAP_FILE_MAGIC, sizeof(header.magic));
+    header.version = MAP_FILE_VERSION;
+    header.elements_count = map.elements_count;
+    header.length = map.length;
+    header.height = map.height;
+    header.chunks_count = (Uint32)ceil(map.length / MAP_CHUNK_WIDTH);
+    if (header.chunks_count < 1) header.chunks_count = 1;
+    header.chunk_width = map.length > 0 ? map.length / header.chunks_count : MAP_CHUNK_WIDTH; // Chunks must tile the map exactly for the wraparound to line up.
+    header.elements_offset = (sizeof(header) + (header.chunks_count + 1) * sizeof(Uint32) + 7) / 8 * 8;
+
+    double **sorted = (double**)SDL_malloc((map.elements_count > 0 ? map.elements_count : 1) * sizeof(double*));
+    Uint32 *chunk_table = (Uint32*)SDL_calloc(header.elements_offset - sizeof(header), 1); // Includes the padding up to elements_offset.
+    for (int i = 0; i < map.elements_count; i++) {
+        sorted[i] = map.elements[i];
+        if (map.elements[i][2] > header.max_element_width) header.max_element_width = map.elements[i][2];
+        chunk_table[map_chunk_of(map.elements[i][0], header.chunk_width, header.chunks_count) + 1]++;
+    }
+    qsort(sorted, map.elements_count, sizeof(double*), compare_elements_by_x);
+    for (Uint32 c = 0; c < header.chunks_count; c++) chunk_table[c + 1] += chunk_table[c]; // Counts to offsets.
+
+    FILE *fptr = fopen(binary_path, "wb");
+    bool ok = fptr != NULL
+    && fwrite(&header, sizeof(header), 1, fptr) == 1
+    && fwrite(chunk_table, header.elements_offset - sizeof(header), 1, fptr) == 1;
+    for (int i = 0; ok && i < map.elements_count; i++) ok = fwrite(sorted[i], sizeof(*map.elements), 1, fptr) == 1;
+    if (fptr != NULL && fclose(fptr) != 0) ok = false;
+    SDL_free(sorted);
+    SDL_free(chunk_table);
+    if (!ok) {
+        SDL_Log("Error writing the compiled map file %s!", binary_path);
+        free_map(&map);
+        return 1;
+    }
+    SDL_Log("Compiled %s (%d platforms in %d chunks) into %s.", text_path, map.elements_count, header.chunks_count, binary_path);
+    free_map(&map);
+    return 0;
+}
+
+// Platforms whose span may overlap the map stretch [from, to], wherever the map keeps them. See query_map_index().
+int query_map(Map *map, double from, double to, double **out, int capacity) {
+    if (map->stream != NULL) return query_map_stream(map->stream, from, to, out, capacity);
+    return query_map_index(&map->index, from, to, out, capacity);
+}
+
+
+// Fairies and stars. Their spawn records are read from the map's fairies.txt and stars.txt, while the entities themselves live in a pool
+// of fixed size: they're spawned from the records as they scroll into view and freed again once they scroll out of it,
+// so that a map with thousands of them costs no more per tick than the few on the screen, and spawning never allocates.
+enum EntityKind {
+    ENTITY_FAIRY, // Collected by touching it.
+    ENTITY_STAR // Kills on contact, unless dashed through, which destroys it.
+};
+
+enum EntityState {
+    ENTITY_FREE,
+    ENTITY_ACTIVE,
+    ENTITY_SPENT // Collected or destroyed. Keeps its record from spawning again until it has scrolled out of view.
+};
+
+struct EntityPool {
+    // Spawn records are rows of x, y, width and height, just like the platforms, so the same kind of index finds the ones near a stretch of the map.
+    int records_count;
+    double (*records)[4];
+    Uint8 *record_kind;
+    int *record_entity; // Entity currently spawned from the record, -1 if none.
+    MapIndex index;
+    // Entities. One contiguous array per component, all indexed by the entity number.
+    float *x, *y, *width, *height; // Map coordinates of the top left corner, and size.
+    float *phase; // Animation phase.
+    Uint8 *kind, *state;
+    int *record; // Spawn record the entity came from.
+    int *free_list, free_count; // Free entity numbers, reused last in, first out.
+    int used; // No entity past this number has ever been spawned, so the passes over the pool stop here.
+    int collected, destroyed; // Fairies collected and stars destroyed so far.
+};
+
+void init_entity_pool(EntityPool *pool) {
+    memset(pool, 0, sizeof(*pool));
+    pool->x = (float*)SDL_malloc(ENTITY_POOL_SIZE * sizeof(float));
+    pool->y = (float*)SDL_malloc(ENTITY_POOL_SIZE * sizeof(float));
+    pool->width = (float*)SDL_malloc(ENTITY_POOL_SIZE * sizeof(float));
+    pool->height = (float*)SDL_malloc(ENTITY_POOL_SIZE * sizeof(float));
+    pool->phase = (float*)SDL_malloc(ENTITY_POOL_SIZE * sizeof(float));
+    pool->kind = (Uint8*)SDL_malloc(ENTITY_POOL_SIZE * sizeof(Uint8));
+    pool->state = (Uint8*)SDL_calloc(ENTITY_POOL_SIZE, sizeof(Uint8)); // ENTITY_FREE
+    pool->record = (int*)SDL_malloc(ENTITY_POOL_SIZE * sizeof(int));
+    pool->free_list = (int*)SDL_malloc(ENTITY_POOL_SIZE * sizeof(int));
+    for (int e = 0; e < ENTITY_POOL_SIZE; e++) pool->free_list[e] = ENTITY_POOL_SIZE - 1 - e; // So that entity 0 is the first one handed out.
+    pool->free_count = ENTITY_POOL_SIZE;
+}
+
+// Append the spawn records in a file to the pool. The file holds the number of entities on the first line, then the x and y coordinates
+// of one of them per line. A missing or empty file simply means there are none on the map.
+void load_entities (EntityPool *pool, const char *path, int kind, double size) {
+    int count, fscanf_status;
+    FILE *fptr = fopen(path, "r");
+    if (fptr == NULL) return;
+    if (fscanf(fptr, "%d", &count) != 1 || count <= 0) {
+        fclose(fptr);
+        return;
+    }
+    pool->records = (double(*)[4])SDL_realloc(pool->records, (pool->records_count + count) * sizeof(*pool->records));
+    pool->record_kind = (Uint8*)SDL_realloc(pool->record_kind, (pool->records_count + count) * sizeof(Uint8));
+    for (int i = 0; i < count; i++) {
+        double *record = pool->records[pool->records_count];
+        fscanf_status = fscanf(fptr, "%lf %lf", &record[0], &record[1]);
+        if (fscanf_status != 2) { // Exactly 2 numbers in each line.
+            SDL_Log("Error reading %s! Incorrect data in line %d!", path, i + 2);
+            fclose(fptr);
+            exit(1);
+        }
+        record[2] = record[3] = size;
+        pool->record_kind[pool->records_count++] = kind;
+    }
+    fclose(fptr);
+}
+
+void load_fairies (EntityPool *pool) {
+    load_entities(pool, "./map/fairies.txt", ENTITY_FAIRY, FAIRY_SIZE);
+}
+
+void load_stars (EntityPool *pool) {
+    load_entities(pool, "./map/stars.txt", ENTITY_STAR, STAR_SIZE);
+}
+
+// Index the spawn records once they've all been loaded.
+void build_entity_index (EntityPool *pool, double map_length) {
+    build_map_index(&pool->index, map_length, pool->records_count, pool->records);
+    pool->record_entity = (int*)SDL_malloc((pool->records_count > 0 ? pool->records_count : 1) * sizeof(int));
+    for (int r = 0; r < pool->records_count; r++) pool->record_entity[r] = -1;
+}
+
+void free_entity (EntityPool *pool, int e) {
+    pool->record_entity[pool->record[e]] = -1;
+    pool->state[e] = ENTITY_FREE;
+    pool->free_list[pool->free_count++] = e;
+}
+
+// Free every entity, for a new game.
+void reset_entities (EntityPool *pool) {
+    for (int e = 0; e < pool->used; e++) {
+        if (pool->state[e] != ENTITY_FREE) free_entity(pool, e);
+    }
+    pool->collected = pool->destroyed = 0;
+}
+
+void free_entity_pool (EntityPool *pool) {
+    SDL_free(pool->x);
+    SDL_free(pool->y);
+    SDL_free(pool->width);
+    SDL_free(pool->height);
+    SDL_free(pool->phase);
+    SDL_free(pool->kind);
+    SDL_free(pool->state);
+    SDL_free(pool->record);
+    SDL_free(pool->free_list);
+    SDL_free(pool->records);
+    SDL_free(pool->record_kind);
+    SDL_free(pool->record_entity);
+    free_map_index(&pool->index);
+}
+
+// Horizontal screen position of map x coordinate x, taking the shorter way around the looping map.
+inline double entity_screen_x (double x, double map_offset, double map_length) {
+    double screen_x = x - map_offset;
+    if (screen_x < -map_length / 2) screen_x += map_length;
+    else if (screen_x >= map_length / 2) screen_x -= map_length;
+    return screen_x;
+}
+
+// Spawn the records coming into view, animate the entities and free the ones that have scrolled out of view. Called every tick.
+void update_entities (EntityPool *pool, double map_offset, double map_length) {
+    ArenaScope scratch(&frame_arena);
+    double **nearby = (double**)arena_alloc(&frame_arena, MAX_QUERY_RESULTS * sizeof(double*));
+    int nearby_count = nearby != NULL ? query_map_index(&pool->index, map_offset, map_offset + SCREEN_WIDTH + ENTITY_SPAWN_AHEAD, nearby, MAX_QUERY_RESULTS) : 0;
+    for (int n = 0; n < nearby_count; n++) {
+        int r = (double(*)[4])nearby[n] - pool->records, e;
+        if (pool->record_entity[r] >= 0 || entity_screen_x(nearby[n][0] + nearby[n][2], map_offset, map_length) < 0) continue; // Already spawned, or already past.
+        if (pool->free_count == 0) break; // The pool is full, the rest spawn once some entities have been freed.
+        e = pool->free_list[--pool->free_count];
+        if (e >= pool->used) pool->used = e + 1;
+        pool->x[e] = nearby[n][0];
+        pool->y[e] = nearby[n][1];
+        pool->width[e] = nearby[n][2];
+        pool->height[e] = nearby[n][3];
+        pool->phase[e] = 0;
+        pool->kind[e] = pool->record_kind[r];
+        pool->state[e] = ENTITY_ACTIVE;
+        pool->record[e] = r;
+        pool->record_entity[r] = e;
+    }
+
+    for (int e = 0; e < pool->used; e++) {
+        if (pool->state[e] == ENTITY_FREE) continue;
+        if (entity_screen_x(pool->x[e] + pool->width[e], map_offset, map_length) < 0) {
+            free_entity(pool, e);
+            continue;
+        }
+        pool->phase[e] += ENTITY_PHASE_STEP;
+        if (pool->kind[e] == ENTITY_FAIRY) pool->y[e] = pool->records[pool->record[e]][1] + sin(pool->phase[e]) * FAIRY_HOVER; // Fairies hover up and down.
+    }
+}
+
+// Test the player's box (centered at screen position x, y, with the same 0.4 width margins as the platforms use) against the entities around it.
+// Like the platforms in Unicorn::detect_collisions(), only the spawn records the index finds near the player are looked at, and of those only
+// the ones with an active entity. Touched fairies are collected and stars dashed through are destroyed. Returns 2 if the player has crashed into a star, 0 otherwise.
+int collide_entities (EntityPool *pool, double map_offset, double map_length, float x, float y, int width, int height, bool dashing) {
+    int result = 0;
+    ArenaScope scratch(&frame_arena);
+    double **nearby = (double**)arena_alloc(&frame_arena, MAX_QUERY_RESULTS * sizeof(double*));
+    int nearby_count = nearby != NULL ? query_map_index(&pool->index, map_offset + x - width, map_offset + x + width, nearby, MAX_QUERY_RESULTS) : 0;
+    for (int n = 0; n < nearby_count; n++) {
+        int e = pool->record_entity[(double(*)[4])nearby[n] - pool->records];
+        if (e < 0 || pool->state[e] != ENTITY_ACTIVE) continue; // Not spawned yet, or already spent.
+        double screen_x = entity_screen_x(pool->x[e], map_offset, map_length);
+        bool touching = x + 0.4 * width >= screen_x && x - 0.4 * width <= screen_x + pool->width[e]
+        && y + 0.4 * height >= pool->y[e] && y - 0.4 * height <= pool->y[e] + pool->height[e];
+        if (!touching) continue;
+        pool->state[e] = ENTITY_SPENT;
+        if (pool->kind[e] == ENTITY_FAIRY) pool->collected++;
+        else if (dashing) pool->destroyed++;
+        else result = 2;
+    }
+    return result;
+}
+
+// Screen rectangles of the active entities of the given kind. Returns their number.
+int visible_entities (EntityPool *pool, int kind, double map_offset, double vertical_map_offset, double map_length, SDL_Rect *out, int capacity) {
+    int count = 0;
+    for (int e = 0; e < pool->used && count < capacity; e++) {
+        if (pool->state[e] != ENTITY_ACTIVE || pool->kind[e] != kind) continue;
+        out[count++] = {(int)entity_screen_x(pool->x[e], map_offset, map_length), (int)(pool->y[e] - vertical_map_offset), (int)pool->width[e], (int)pool->height[e]};
+    }
+    return count;
+}
+
+void draw_entities (Rasterizer *raster, double map_offset, double vertical_map_offset, double map_length, EntityPool *pool, Uint32 fairy_color, Uint32 star_color) {
+    ArenaScope scratch(&frame_arena);
+    SDL_Rect *entities = (SDL_Rect*)arena_alloc(&frame_arena, ENTITY_POOL_SIZE * sizeof(SDL_Rect));
+    if (entities == NULL) return;
+    int count = visible_entities(pool, ENTITY_FAIRY, map_offset, vertical_map_offset, map_length, entities, ENTITY_POOL_SIZE);
+    for (int i = 0; i < count; i++) RasterRectangle(raster, entities[i].x, entities[i].y, entities[i].w, entities[i].h, fairy_color, fairy_color);
+    count = visible_entities(pool, ENTITY_STAR, map_offset, vertical_map_offset, map_length, entities, ENTITY_POOL_SIZE);
+    for (int i = 0; i < count; i++) RasterRectangle(raster, entities[i].x, entities[i].y, entities[i].w, entities[i].h, star_color, star_color);
+}
+
+// Same as draw_entities(), but queues them into the geometry batch.
+void draw_entities_geometry (GeometryBatch *batch, double map_offset, double vertical_map_offset, double map_length, EntityPool *pool, SDL_Color fairy_color, SDL_Color star_color) {
+    ArenaScope scratch(&frame_arena);
+    SDL_Rect *entities = (SDL_Rect*)arena_alloc(&frame_arena, ENTITY_POOL_SIZE * sizeof(SDL_Rect));
+    if (entities == NULL) return;
+    int count = visible_entities(pool, ENTITY_FAIRY, map_offset, vertical_map_offset, map_length, entities, ENTITY_POOL_SIZE);
+    for (int i = 0; i < count; i++) BatchQuad(batch, NULL, entities[i].x, entities[i].y, entities[i].w, entities[i].h, fairy_color, 0, 0, 0, 0);
+    count = visible_entities(pool, ENTITY_STAR, map_offset, vertical_map_offset, map_length, entities, ENTITY_POOL_SIZE);
+    for (int i = 0; i < count; i++) BatchQuad(batch, NULL, entities[i].x, entities[i].y, entities[i].w, entities[i].h, star_color, 0, 0, 0, 0);
+}
+
+// Platforms textured with the grassy tiles. Every platform is composed from tiles once, into an image of its own that's kept around while
+// it's on the screen, so that a frame only draws one image per platform instead of blitting each of its tiles.
+struct CachedPlatform {
+    double key[4]; // The platform's x, y, width and height, which stay the same even when a streamed chunk gets loaded again.
+    SDL_Surface *surface; // The composed image for the surface backend...
+    SDL_Texture *texture; // ...or for the geometry backend.
+    int width, height; // Of the image. At most PLATFORM_CACHE_MAX_WIDTH wide, repeated along wider platforms.
+    long long last_used; // Frame the platform was last drawn in.
+};
+
+struct PlatformCache {
+    SDL_Surface *tiles[PLATFORM_TILES_COUNT]; // Converted to ARGB8888 like the screen, so that composing is a plain copy.
+    int tiles_count; // Platforms are drawn as plain rectangles if none could be loaded.
+    SDL_Renderer *renderer; // Non-NULL with the geometry backend, which needs textures rather than surfaces.
+    CachedPlatform entries[PLATFORM_CACHE_SIZE];
+    int count;
+    size_t bytes; // Total size of the images.
+    long long frame;
+    int composed; // Number of images composed so far. Each one is allocated, so frames that compose any aren't expected to be allocation free.
+};
+
+void init_platform_cache(PlatformCache *cache, SDL_Renderer *renderer) {
+    memset(cache, 0, sizeof(*cache));
+    cache->renderer = renderer;
+}
+
+// Add a tile, already converted to ARGB8888, to the ones platforms are textured with. The cache takes it over.
+void add_platform_tile(PlatformCache *cache, SDL_Surface *tile) {
+    if (tile == NULL || cache->tiles_count == PLATFORM_TILES_COUNT) return;
+    SDL_SetSurfaceBlendMode(tile, SDL_BLENDMODE_NONE);
+    cache->tiles[cache->tiles_count++] = tile;
+}
+
+void free_cached_platform(PlatformCache *cache, int i) {
+    CachedPlatform *entry = &cache->entries[i];
+    if (entry->surface != NULL) SDL_FreeSurface(entry->surface);
+    if (entry->texture != NULL) SDL_DestroyTexture(entry->texture);
+    cache->bytes -= (size_t)entry->width * entry->height * 4;
+    cache->entries[i] = cache->entries[--cache->count];
+}
+
+void free_platform_cache(PlatformCache *cache) {
+    while (cache->count > 0) free_cached_platform(cache, cache->count - 1);
+    for (int i = 0; i < cache->tiles_count; i++) SDL_FreeSurface(cache->tiles[i]);
+    cache->tiles_count = 0;
+}
+
+// Make room for another image of the given size. Platforms the map has scrolled past go first, as they only come back once the map loops,
+// then the ones drawn longest ago. Whatever is on the screen right now stays. Returns false if there's no room to be made.
+bool evict_platforms(PlatformCache *cache, size_t bytes, double map_offset) {
+    while (cache->count == PLATFORM_CACHE_SIZE || (cache->count > 0 && cache->bytes + bytes > PLATFORM_CACHE_BYTES)) {
+        int victim = -1;
+        bool victim_behind = false;
+        for (int i = 0; i < cache->count; i++) {
+            CachedPlatform *entry = &cache->entries[i];
+            bool behind = entry->key[0] + entry->key[2] < map_offset;
+            if (entry->last_used == cache->frame) continue;
+            if (victim < 0 || (behind && !victim_behind) || (behind == victim_behind && entry->last_used < cache->entries[victim].last_used)) {
+                victim = i;
+                victim_behind = behind;
+            }
+        }
+        if (victim < 0) return false;
+        free_cached_platform(cache, victim);
+    }
+    return true;
+}
+
+// Compose a platform from the tiles: the first row of tiles shows the grass, the rows below repeat the lower half of the tiles, i.e. the soil.
+// Which tile goes where depends on the position on the map only, so a platform looks the same every time it gets composed.
+SDL_Surface* compose_platform(PlatformCache *cache, double *element, int width, int height) {
+    SDL_Surface *surface = SDL_CreateRGBSurface(0, width, height, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    if (surface == NULL) return NULL;
+    for (int x = 0; x < width; x += PLATFORM_TILE_SIZE) {
+        Uint32 column = (Uint32)(long long)floor((element[0] + x) / PLATFORM_TILE_SIZE);
+        SDL_Surface *tile = cache->tiles[(column * 2654435761u >> 16) % cache->tiles_count];
+        for (int y = 0; y < height; y += y == 0 ? PLATFORM_TILE_SIZE : PLATFORM_TILE_SIZE / 2) {
+            SDL_Rect source = {0, y == 0 ? 0 : PLATFORM_TILE_SIZE / 2, PLATFORM_TILE_SIZE, y == 0 ? PLATFORM_TILE_SIZE : PLATFORM_TILE_SIZE / 2};
+            SDL_Rect target = {x, y, source.w, source.h};
+            SDL_BlitSurface(tile, &source, surface, &target); // Clipped to the surface along the edges.
+        }
+    }
+    return surface;
+}
+
+// The cached image of a platform, composed now if it isn't cached yet. NULL if the platform has to be drawn plain.
+CachedPlatform* cached_platform(PlatformCache *cache, double *element, double map_offset) {
+    int width = (int)fmin(element[2], PLATFORM_CACHE_MAX_WIDTH), height = (int)element[3];
+    CachedPlatform *entry;
+    if (cache->tiles_count == 0 || width <= 0 || height <= 0) return NULL;
+    for (int i = 0; i < cache->count; i++) {
+        entry = &cache->entries[i];
+        if (entry->key[0] == element[0] && entry->key[1] == element[1] && entry->key[2] == element[2] && entry->key[3] == element[3]) {
+            entry->last_used = cache->frame;
+            return entry;
+        }
+    }
+    if (!evict_platforms(cache, (size_t)width * height * 4, map_offset)) return NULL;
+    SDL_Surface *surface = compose_platform(cache, element, width, height);
+    if (surface == NULL) return NULL;
+    cache->composed++;
+    entry = &cache->entries[cache->count];
+    memset(entry, 0, sizeof(*entry));
+    if (cache->renderer != NULL) {
+        entry->texture = SDL_CreateTextureFromSurface(cache->renderer, surface);
+        SDL_FreeSurface(surface);
+        if (entry->texture == NULL) return NULL;
+    } else {
+        SDL_SetSurfaceBlendMode(surface, SDL_BLENDMODE_NONE);
+        entry->surface = surface;
+    }
+    memcpy(entry->key, element, sizeof(entry->key));
+    entry->width = width;
+    entry->height = height;
+    entry->last_used = cache->frame;
+    cache->bytes += (size_t)width * height * 4;
+    cache->count++;
+    return entry;
+}
+
+// Screen rectangles (x, y, width, height) of the platforms visible at the given offsets, in drawing order. Returns their number.
+// elements gets the platforms themselves, in the same order.
+int visible_platforms(Map *map, double map_offset, double vertical_map_offset, SDL_Rect *out, double **elements, int capacity) {
+    ArenaScope scratch(&frame_arena);
+    int x, count = 0;
+    double map_length = map->length, **visible = (double**)arena_alloc(&frame_arena, MAX_QUERY_RESULTS * sizeof(double*));
+    if (visible == NULL) return 0;
+    int visible_count = query_map(map, map_offset - 1, map_offset + SCREEN_WIDTH + 1, visible, MAX_QUERY_RESULTS); // Only the platforms that can be on the screen. One pixel of slack for the truncation to int below.
+    for (int v = 0; v < visible_count && count < capacity; v++) { // For each map element that might be visible
+        double *element = visible[v];
+        if (element[0] < SCREEN_WIDTH && map_offset >= map_length - SCREEN_WIDTH) { // If it is one of the elements that fit within the first segment of map of length equal to screen width AND we're drawing the region of the map when map looping occurs
+            x = element[0] - map_offset + map_length; // Then let's cheat a little and say it lies beneath the map.
+        }
+        else x = (element[0] - map_offset);
+
+        if ((x <= SCREEN_WIDTH && x >= 0) // Left edge of the platform is within the screen
+        || (x + element[2] <= SCREEN_WIDTH && x + element[2] >= 0) // Right edge of the platform is within the screen
+        ) {
+            // TODO: Modify this once the vertical offset is added
+            if (elements != NULL) elements[count] = element;
+            out[count++] = {x, (int)(element[1] - vertical_map_offset), (int)element[2], (int)element[3]};
+        }
+    }
+    return count;
+}
+
+// Draws the platforms textured from the platform cache, or as plain rectangles when there are no tiles.
+void draw_map (Rasterizer *raster, double map_offset, double vertical_map_offset, Map *map, PlatformCache *cache, Uint32 outline_color, Uint32 fill_color) {
+    ArenaScope scratch(&frame_arena); // The query's results are only needed until the platforms are recorded.
+    SDL_Rect *platforms = (SDL_Rect*)arena_alloc(&frame_arena, MAX_QUERY_RESULTS * sizeof(SDL_Rect));
+    double **elements = (double**)arena_alloc(&frame_arena, MAX_QUERY_RESULTS * sizeof(double*));
+    if (platforms == NULL || elements == NULL) return;
+    int platforms_count = visible_platforms(map, map_offset, vertical_map_offset, platforms, elements, MAX_QUERY_RESULTS);
+    for (int i = 0; i < platforms_count; i++) {
+        CachedPlatform *image = cached_platform(cache, elements[i], map_offset);
+        if (image == NULL) {
+            RasterRectangle(raster, platforms[i].x, platforms[i].y, platforms[i].w, platforms[i].h, outline_color, fill_color);
+            continue;
+        }
+        for (int x = 0; x < platforms[i].w; x += image->width) { // Once, unless the platform is wider than the image.
+            SDL_Rect source = {0, 0, SDL_min(image->width, platforms[i].w - x), image->height};
+            RasterBlit(raster, image->surface, &source, platforms[i].x + x, platforms[i].y);
+        }
+    }
+}
+
+// Same as draw_map(), but queues the platforms into the geometry batch for the renderer instead of drawing them into a surface.
+void draw_map_geometry (GeometryBatch *batch, double map_offset, double vertical_map_offset, Map *map, PlatformCache *cache, SDL_Color outline_color, SDL_Color fill_color) {
+    ArenaScope scratch(&frame_arena);
+    SDL_Rect *platforms = (SDL_Rect*)arena_alloc(&frame_arena, MAX_QUERY_RESULTS * sizeof(SDL_Rect));
+    double **elements = (double**)arena_alloc(&frame_arena, MAX_QUERY_RESULTS * sizeof(double*));
+    SDL_Color white = {0xFF, 0xFF, 0xFF, 0xFF};
+    if (platforms == NULL || elements == NULL) return;
+    int platforms_count = visible_platforms(map, map_offset, vertical_map_offset, platforms, elements, MAX_QUERY_RESULTS);
+    for (int i = 0; i < platforms_count; i++) {
+        CachedPlatform *image = cached_platform(cache, elements[i], map_offset);
+        if (image == NULL) {
+            BatchRectangle(batch, platforms[i].x, platforms[i].y, platforms[i].w, platforms[i].h, outline_color, fill_color);
+            continue;
+        }
+        for (int x = 0; x < platforms[i].w; x += image->width) {
+            int w = SDL_min(image->width, platforms[i].w - x);
+            BatchQuad(batch, image->texture, platforms[i].x + x, platforms[i].y, w, image->height, white, 0, 0, (float)w / image->width, 1);
+        }
+    }
+}
+
+// The map drawn once and then only added to as it scrolls: a ring buffer the size of the screen, in which the map's pixel (x, y) always
+// lands at (x mod width, y mod height). Scrolling moves the window onto the ring instead of any pixels, so a frame only draws and uploads
+// the strips that have just come into view. Map offsets are snapped to whole pixels, which keeps platforms at integer coordinates exactly
+// where a full redraw would put them.
+struct MapLayer {
+    SDL_Surface *surface; // The ring.
+    SDL_Texture *texture; // Its copy for the renderer, updated strip by strip.
+    Rasterizer raster; // Draws into the ring.
+    bool valid; // Whether the ring holds the map at scroll_x, scroll_y at all.
+    long long scroll_x, scroll_y; // Map coordinates of the screen's top left corner, not wrapped around the looping map.
+    double map_offset; // Snapped map offset scroll_x corresponds to, wrapped around the looping map.
+    SDL_Rect dirty[MAP_LAYER_DIRTY_RECTS]; // Parts of the ring drawn this frame, to be uploaded.
+    int dirty_count;
+};
+
+void init_map_layer(MapLayer *layer, SDL_Renderer *renderer, int raster_threads) {
+    memset(layer, 0, sizeof(*layer));
+    layer->surface = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    layer->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+    init_rasterizer(&layer->raster, layer->surface, raster_threads);
+}
+
+void free_map_layer(MapLayer *layer) {
+    free_rasterizer(&layer->raster);
+    SDL_DestroyTexture(layer->texture);
+    SDL_FreeSurface(layer->surface);
+}
+
+// Split the screen rectangle [from, from + length) along one axis into the at most two pieces it takes up within the ring,
+// returning each piece's start on the screen, length and shift from the screen to the ring.
+int ring_pieces(long long scroll, int from, int length, int size, int *starts, int *lengths, int *shifts) {
+    int ring = (int)(((scroll + from) % size + size) % size);
+    if (ring + length <= size) {
+        starts[0] = from;
+        lengths[0] = length;
+        shifts[0] = ring - from;
+        return 1;
+    }
+    starts[0] = from;
+    lengths[0] = size - ring;
+    shifts[0] = ring - from;
+    starts[1] = from + lengths[0];
+    lengths[1] = length - lengths[0];
+    shifts[1] = -starts[1];
+    return 2;
+}
+
+// Record drawing the part of the map that shows within the screen rectangle strip into its place in the ring.
+void draw_map_layer_strip(MapLayer *layer, SDL_Rect strip, Map *map, PlatformCache *cache, Uint32 background, Uint32 outline_color, Uint32 fill_color) {
+    int x_starts[2], x_lengths[2], x_shifts[2], y_starts[2], y_lengths[2], y_shifts[2];
+    int columns = ring_pieces(layer->scroll_x, strip.x, strip.w, SCREEN_WIDTH, x_starts, x_lengths, x_shifts);
+    int rows = ring_pieces(layer->scroll_y, strip.y, strip.h, SCREEN_HEIGHT, y_starts, y_lengths, y_shifts);
+    for (int i = 0; i < columns; i++) for (int j = 0; j < rows; j++) {
+        SDL_Rect piece = {x_starts[i], y_starts[j], x_lengths[i], y_lengths[j]};
+        set_raster_origin(&layer->raster, x_shifts[i], y_shifts[j]);
+        RasterClip(&layer->raster, &piece);
+        RasterFill(&layer->raster, &piece, background);
+        draw_map(&layer->raster, layer->map_offset, (double)layer->scroll_y, map, cache, outline_color, fill_color);
+        if (layer->dirty_count < MAP_LAYER_DIRTY_RECTS) layer->dirty[layer->dirty_count++] = {piece.x + x_shifts[i], piece.y + y_shifts[j], piece.w, piece.h};
+    }
+    set_raster_origin(&layer->raster, 0, 0);
+    RasterClip(&layer->raster, NULL);
+}
+
+// Scroll the layer to the given offsets and record drawing whatever came into view, everything if the view jumped rather than scrolled.
+void scroll_map_layer(MapLayer *layer, Map *map, PlatformCache *cache, double map_offset, double vertical_map_offset, Uint32 background, Uint32 outline_color, Uint32 fill_color) {
+    double snapped = floor(map_offset), map_length = map->length;
+    long long dx = (long long)(snapped - layer->map_offset), dy = (long long)floor(vertical_map_offset) - layer->scroll_y;
+    if (dx < 0 && map_length == floor(map_length)) dx += (long long)map_length; // The map looped.
+    layer->dirty_count = 0;
+    layer->map_offset = snapped;
+    if (!layer->valid || dx < 0 || dx >= SCREEN_WIDTH || dy <= -SCREEN_HEIGHT || dy >= SCREEN_HEIGHT) {
+        layer->scroll_x = (long long)snapped;
+        layer->scroll_y = (long long)floor(vertical_map_offset);
+        layer->valid = true;
+        draw_map_layer_strip(layer, {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT}, map, cache, background, outline_color, fill_color);
+        return;
+    }
+    layer->scroll_x += dx;
+    layer->scroll_y += dy;
+    if (dx > 0) draw_map_layer_strip(layer, {SCREEN_WIDTH - (int)dx, 0, (int)dx, SCREEN_HEIGHT}, map, cache, background, outline_color, fill_color);
+    if (dy > 0) draw_map_layer_strip(layer, {0, SCREEN_HEIGHT - (int)dy, SCREEN_WIDTH, (int)dy}, map, cache, background, outline_color, fill_color);
+    if (dy < 0) draw_map_layer_strip(layer, {0, 0, SCREEN_WIDTH, (int)-dy}, map, cache, background, outline_color, fill_color);
+}
+
+// Upload the strips drawn this frame to the layer's texture.
+void upload_map_layer(MapLayer *layer) {
+    for (int d = 0; d < layer->dirty_count; d++) {
+        SDL_Rect *rect = &layer->dirty[d];
+        SDL_UpdateTexture(layer->texture, rect, (Uint8*)layer->surface->pixels + rect->y * layer->surface->pitch + rect->x * 4, layer->surface->pitch);
+    }
+}
+
+// Copy the layer onto the whole screen: the ring's pieces in the order they show up on the screen.
+void RenderMapLayer(SDL_Renderer *renderer, MapLayer *layer) {
+    int x_starts[2], x_lengths[2], x_shifts[2], y_starts[2], y_lengths[2], y_shifts[2];
+    int columns = ring_pieces(layer->scroll_x, 0, SCREEN_WIDTH, SCREEN_WIDTH, x_starts, x_lengths, x_shifts);
+    int rows = ring_pieces(layer->scroll_y, 0, SCREEN_HEIGHT, SCREEN_HEIGHT, y_starts, y_lengths, y_shifts);
+    for (int i = 0; i < columns; i++) for (int j = 0; j < rows; j++) {
+        SDL_Rect target = {x_starts[i], y_starts[j], x_lengths[i], y_lengths[j]}, source = {target.x + x_shifts[i], target.y + y_shifts[j], target.w, target.h};
+        SDL_RenderCopy(renderer, layer->texture, &source, &target);
+    }
+}
+
+// The parts of the screen surface drawn over this frame and the last one, when only what's drawn on top of the map layer goes into it
+// on a transparent background: everything drawn last frame gets cleared, and both get uploaded.
+struct DirtyRects {
+    SDL_Rect rects[OVERLAY_DIRTY_RECTS];
+    int count; // -1 if there were too many to track, which means the whole screen.
+};
+
+// Record clearing what was drawn into the screen surface last frame. Returns the number of the first command of this frame's drawing.
+int clear_overlay(Rasterizer *raster, DirtyRects *last) {
+    if (last->count < 0) RasterFill(raster, NULL, 0);
+    for (int r = 0; r < last->count; r++) RasterFill(raster, &last->rects[r], 0);
+    return raster->commands_count;
+}
+
+// Work out which parts of the screen surface this frame's drawing covers, from the commands recorded since first.
+void find_overlay_rects(Rasterizer *raster, int first, DirtyRects *current) {
+    SDL_Rect full = {0, 0, raster->target->w, raster->target->h}, bounds, rect;
+    current->count = 0;
+    for (int c = first; c < raster->commands_count && current->count >= 0; c++) {
+        if (raster->commands[c].type == RASTER_CLIP) continue;
+        bounds = raster_command_bounds(&raster->commands[c]);
+        if (!SDL_IntersectRect(&bounds, &full, &rect)) continue;
+        if (current->count == OVERLAY_DIRTY_RECTS) current->count = -1;
+        else current->rects[current->count++] = rect;
+    }
+}
+
+// Upload what was cleared and what was drawn in the screen surface this frame, then remember the latter for clearing next frame.
+void upload_overlay(SDL_Surface *screen, DirtyRects *last, DirtyRects *current, SDL_Texture *texture) {
+    if (last->count < 0 || current->count < 0) SDL_UpdateTexture(texture, NULL, screen->pixels, screen->pitch);
+    else {
+        for (int r = 0; r < last->count; r++) SDL_UpdateTexture(texture, &last->rects[r], (Uint8*)screen->pixels + last->rects[r].y * screen->pitch + last->rects[r].x * 4, screen->pitch);
+        for (int r = 0; r < current->count; r++) SDL_UpdateTexture(texture, &current->rects[r], (Uint8*)screen->pixels + current->rects[r].y * screen->pitch + current->rects[r].x * 4, screen->pitch);
+    }
+    *last = *current;
+}
+
+
+// Test a unicorn-sized box at screen position (x, y) against a single platform [ex, ey, ew, eh] while the map is scrolled by map_offset.
+// Returns 0 if they don't touch, 1 if the unicorn stands on the platform and 2 if the unicorn has crashed into it.
+// Shared by the player and the batch simulation so that both follow exactly the same rules. Branch-free enough to vectorize over many platforms.
+inline int platform_contact(float x, float y, int width, int height, double map_offset, double map_length, double ex, double ey, double ew, double eh) {
+    bool horizontal_collision_condition, vertical_collision_condition, standing;
+    int platform_x;
+
+    if (ex < SCREEN_WIDTH && map_offset >= map_length - SCREEN_WIDTH) { // If it is one of the elements that fit within the first segment of map of length equal to screen width AND we're drawing the region of the map when map looping occurs
+        platform_x = ex - map_offset + map_length; // Then let's cheat a little and say it lies beneath the map.
+    }
+    else platform_x = (ex - map_offset);
+
+    // Check for deadly collisions
+    horizontal_collision_condition =
+    (x + 0.4*width >= platform_x && x + 0.4*width <= platform_x + ew) // IF the right edge of the player sprite is within the horizontal span of the platform
+    || // AND/OR
+    (x - 0.4*width >= platform_x && x - 0.4*width <= platform_x + ew); // the right edge of the player sprite is within the horizontal span of the platform
+
+    vertical_collision_condition =
+    (ey >= y - 0.4*height && ey <= y + 0.35*height)
+    ||
+    (ey + eh >= y - 0.4*height && ey + eh <= y + 0.35*height);
+
+    // Check for bottom contact (i.e. if the unicorn stands on a platform)
+    standing = x + 0.4 * width >= platform_x
+    && x - 0.4 * width <= platform_x + ew
+    && y + height/2 >= ey
+    && y + height/2 <= ey + eh;
+
+    if (vertical_collision_condition && horizontal_collision_condition) return 2;
+    return standing;
+}
+
+Uint32 xorshift32(Uint32 *state) {
+    Uint32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Whether a unicorn of the given size standing on a platform from_width wide that ends at x = 0 can make it onto the next platform, to_width wide,
+// gap pixels further on and rise pixels higher up (negative if lower). Tries a few simple ways of playing: taking off at a few distances from the edge
+// (as long as they're on the platform) or just running off it, holding the jump for a few lengths of time, then maybe double jumping or dashing.
+// Only landing with the unicorn's middle over the next platform counts. Simulated with the very same physics and collision tests as game_tick()
+// and Unicorn::detect_collisions(), so whatever passes is reachable for sure.
+bool platform_reachable(double from_width, double gap, double to_width, double rise, int width, int height) {
+    const int takeoffs[] = {0, 40, 80, 160, 240}, holds[] = {0, 5, 10, 20, 35}, followups[][3] = { // Second jump tick and its hold, or dash tick.
+        {-1, 0, -1}, {10, 10, -1}, {10, 35, -1}, {30, 10, -1}, {30, 35, -1}, {50, 10, -1}, {50, 35, -1}, {-1, 0, 10}, {-1, 0, 25}, {-1, 0, 40}};
+    double platforms[2][4] = {{-from_width, 1000, from_width, 50}, {gap, 1000 - rise, to_width, 50}}; // Far from the top of the map, the wraparound rule must not kick in.
+    for (int takeoff : takeoffs) for (int hold : holds) for (const int *followup : followups) {
+        float x = -takeoff, y = platforms[0][1] - height/2, y_velocity = 0, y_acc = 0;
+        bool on_surface = true, double_jump_ready = true, dashing = false, failed = false;
+        int dash_timer = 0;
+        if (takeoff > from_width) continue; // Not on the platform.
+        if (hold == 0 && followup[0] >= 0) continue; // Only jumps are followed up.
+        for (int t = 0; t < ENDLESS_SIMULATION_TICKS && !failed; t++) {
+            if ((t == 0 && hold > 0) || t == followup[0]) { // Jump, same as Unicorn::jump().
+                if (!dashing && (on_surface || (double_jump_ready && y_acc == 0.))) {
+                    if (!on_surface) double_jump_ready = false;
+                    y_acc = Y_ACC_CONST;
+                    y_velocity = JUMP_INITIAL_PUSH;
+                }
+            }
+            if ((t == hold && hold > 0) || t == followup[0] + followup[1]) y_acc = 0.; // Release.
+            if (t == followup[2]) { // Dash, same as Unicorn::dash().
+                dashing = true;
+                dash_timer = 0;
+                double_jump_ready = true;
+            }
+            x += STARTING_X_VELOCITY * (1. + dashing * 0.8); // Moving the unicorn instead of the map.
+            if (dashing) y_velocity = 0;
+            else y += y_velocity;
+            if (!on_surface) {
+                y_velocity = fmin(DRAG, y_velocity + GRAVITY + y_acc);
+                if (y_velocity <= -(JUMP_STRENGTH * (1 + 0.3 * double_jump_ready))) y_acc = 0.;
+            }
+            on_surface = false;
+            if (y - height/2 > platforms[0][1] + ENDLESS_MAX_DROP + 100) break; // Fell past the next platform.
+            if (dashing && ++dash_timer > DASH_LENGTH) {
+                dashing = false;
+                dash_timer = 0;
+            }
+            for (int p = 0; p < 2 && !failed; p++) {
+                int contact = platform_contact(x, y, width, height, 0, 1e12, platforms[p][0], platforms[p][1], platforms[p][2], platforms[p][3]);
+                if (contact == 2) failed = true;
+                else if (contact == 1 && p == 1 && x >= gap && x <= gap + to_width) return true;
+                else if (contact == 1) { // Landing on the very edge of the next platform doesn't count, but the unicorn stands on it all the same.
+                    y = platforms[p][1] - height/2;
+                    y_velocity = 0;
+                    on_surface = true;
+                    double_jump_ready = true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Find the range of heights the endless generator can roam in: every platform top within it has to be able to reach the anchor platform
+// the next chunk starts with, over the smallest gap and from the narrowest platform, so that any chunk can always be closed.
+void find_endless_heights(MapStream *stream) {
+    stream->highest = stream->lowest = ENDLESS_ANCHOR_Y;
+    while (stream->highest - 10 >= ENDLESS_ANCHOR_Y - ENDLESS_MAX_RISE && platform_reachable(ENDLESS_MIN_WIDTH, ENDLESS_MIN_GAP, ENDLESS_ANCHOR_WIDTH,
+        stream->highest - 10 - ENDLESS_ANCHOR_Y, stream->unicorn_width, stream->unicorn_height)) stream->highest -= 10;
+    while (stream->lowest + 10 <= fmin(ENDLESS_ANCHOR_Y + ENDLESS_MAX_DROP, ENDLESS_MAP_HEIGHT - ENDLESS_PLATFORM_THICKNESS) && platform_reachable(ENDLESS_MIN_WIDTH, ENDLESS_MIN_GAP,
+        ENDLESS_ANCHOR_WIDTH, stream->lowest + 10 - ENDLESS_ANCHOR_Y, stream->unicorn_width, stream->unicorn_height)) stream->lowest += 10;
+}
+
+// Generate a chunk of an endless map. Chunks only depend on the seed and their number, so they can be generated in any order and again after
+// having been evicted. Each one starts with an anchor platform at the same height and ends with a gap the last platform can clear to reach
+// the next chunk's anchor, so consecutive chunks always fit together. Runs on the loader thread.
+void generate_chunk(MapStream *stream, ChunkSlot *slot) {
+    Uint32 rng = stream->seed * 0x9E3779B1u ^ (Uint32)slot->chunk * 0x85EBCA77u;
+    double start = slot->chunk * stream->chunk_width, end = start + stream->chunk_width, x, y = ENDLESS_ANCHOR_Y, gap, last_width = ENDLESS_ANCHOR_WIDTH;
+    int count = 0, width = stream->unicorn_width, height = stream->unicorn_height;
+    double (*elements)[4] = slot->elements;
+    if (rng == 0) rng = 1; // xorshift gets stuck at 0.
+    xorshift32(&rng);
+
+    elements[count][0] = start;
+    elements[count][1] = ENDLESS_ANCHOR_Y;
+    elements[count][2] = ENDLESS_ANCHOR_WIDTH;
+    elements[count++][3] = ENDLESS_PLATFORM_THICKNESS;
+    x = start + ENDLESS_ANCHOR_WIDTH;
+
+    while (count < stream->chunk_capacity - 1) { // Random platforms, each reachable from the one before, while they fit.
+        bool placed = false;
+        for (int attempt = 0; attempt < ENDLESS_ATTEMPTS && !placed; attempt++) {
+            double next_gap = ENDLESS_MIN_GAP + xorshift32(&rng) % (ENDLESS_MAX_GAP - ENDLESS_MIN_GAP + 1);
+            double next_width = ENDLESS_MIN_WIDTH + xorshift32(&rng) % (ENDLESS_MAX_WIDTH - ENDLESS_MIN_WIDTH + 1);
+            double next_y = y + (double)(xorshift32(&rng) % (ENDLESS_MAX_RISE + ENDLESS_MAX_DROP + 1)) - ENDLESS_MAX_RISE;
+            next_y = fmin(fmax(next_y, stream->highest), stream->lowest);
+            if (x + next_gap + next_width > end - ENDLESS_MIN_GAP) continue; // Has to leave room for the jump to the next anchor.
+            if (!platform_reachable(last_width, next_gap, next_width, y - next_y, width, height)) continue;
+            elements[count][0] = x + next_gap;
+            elements[count][1] = next_y;
+            elements[count][2] = next_width;
+            elements[count++][3] = ENDLESS_PLATFORM_THICKNESS;
+            x += next_gap + next_width;
+            y = next_y;
+            last_width = next_width;
+            placed = true;
+        }
+        if (!placed) break;
+    }
+
+    gap = ENDLESS_MIN_GAP + xorshift32(&rng) % (ENDLESS_MAX_GAP - ENDLESS_MIN_GAP + 1); // The jump to the next anchor. The smallest gap always works.
+    // The last platform gets stretched up to the gap, taking off from anywhere along it.
+    if (gap > end - x || !platform_reachable(last_width + end - gap - x, gap, ENDLESS_ANCHOR_WIDTH, y - ENDLESS_ANCHOR_Y, width, height)) gap = ENDLESS_MIN_GAP;
+    while (x < end - gap && count < stream->chunk_capacity) { // Stretch the last platform up to the gap, in pieces no wider than the widest platform.
+        double piece = fmin(end - gap - x, ENDLESS_MAX_WIDTH);
+        elements[count][0] = x;
+        elements[count][1] = y;
+        elements[count][2] = piece;
+        elements[count++][3] = ENDLESS_PLATFORM_THICKNESS;
+        x += piece;
+    }
+    slot->elements_count = count;
+}
+
+// Set up an endless map: a huge virtual map whose chunks are generated ahead of the player from the seed and recycled behind them,
+// through the same slots compiled maps are streamed with. Memory use stays the same however long the run.
+void open_endless_stream(Uint32 seed, int unicorn_width, int unicorn_height, Map *map) {
+    MapStream *stream = (MapStream*)SDL_calloc(1, sizeof(MapStream));
+    stream->seed = seed;
+    stream->unicorn_width = unicorn_width;
+    stream->unicorn_height = unicorn_height;
+    stream->chunks_count = ENDLESS_CHUNKS;
+    stream->chunk_width = MAP_CHUNK_WIDTH;
+    stream->length = (double)ENDLESS_CHUNKS * MAP_CHUNK_WIDTH;
+    stream->max_element_width = fmax(ENDLESS_MAX_WIDTH, ENDLESS_ANCHOR_WIDTH);
+    stream->chunk_capacity = MAP_CHUNK_WIDTH / (ENDLESS_MIN_GAP + ENDLESS_MIN_WIDTH) + 2 + MAP_CHUNK_WIDTH / ENDLESS_MAX_WIDTH + 1; // Random platforms, plus the anchor, plus the pieces of the last one.
+    find_endless_heights(stream);
+    SDL_Log("Endless map with seed %u, platforms between heights %.0f and %.0f.", seed, stream->highest, stream->lowest);
+    start_map_stream(stream, stream->chunk_capacity, ENDLESS_MAP_HEIGHT, 0, map);
+}
+
+// Images loaded from disk, each kept once under its path and the pixel format it was converted to, however many times it's used.
+// Everybody using one holds a SurfaceHandle to it, and trim_resource_cache() lets go of the ones nobody else holds on to any more.
+struct CachedImage {
+    char path[128];
+    Uint32 format; // 0 for the file's own.
+    SurfaceHandle surface;
+};
+
+struct ResourceCache {
+    CachedImage images[RESOURCE_CACHE_SIZE];
+    int count;
+};
+
+// Keep an image, taking the reference to it over. Returns a handle to it, which is all that's left of it if the cache is full.
+SurfaceHandle cache_surface(ResourceCache *cache, const char *path, Uint32 format, SDL_Surface *surface) {
+    if (surface == NULL) return SurfaceHandle();
+    if (cache->count == RESOURCE_CACHE_SIZE) {
+        SDL_Log("Too many images, not caching %s.", path);
+        return SurfaceHandle(surface);
+    }
+    CachedImage *image = &cache->images[cache->count++];
+    snprintf(image->path, sizeof(image->path), "%s", path);
+    image->format = format;
+    image->surface = SurfaceHandle(surface);
+    return image->surface;
 }
 
+// The image loaded from path in the given format, an empty handle if it isn't in the cache.
+SurfaceHandle cached_surface(ResourceCache *cache, const char *path, Uint32 format) {
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->images[i].format == format && strcmp(cache->images[i].path, path) == 0) return cache->images[i].surface;
+    }
+    return SurfaceHandle();
+}
 
-// draw a vertical (when dx = 0, dy = 1) or horizontal (when dx = 1, dy = 0) line
-void DrawLine(SDL_Surface *screen, int x, int y, int l, int dx, int dy, Uint32 color) {
-	for(int i = 0; i < l; i++) {
-        DrawPixel(screen, x, y, color);
-        x += dx;
-        y += dy;
+// Free the images only the cache still holds a reference to, e.g. the ones already packed into a texture.
+void trim_resource_cache(ResourceCache *cache) {
+    for (int i = cache->count - 1; i >= 0; i--) {
+        if (cache->images[i].surface->refcount > 1) continue;
+        cache->images[i] = cache->images[--cache->count];
+        cache->images[cache->count] = CachedImage();
     }
 }
 
+// Files loaded at startup on a pool of threads, so that decoding them overlaps with each other and with whatever the main thread does meanwhile,
+// e.g. opening the window. Everything is queued first, then the threads pick the assets up in the order they were queued. The main thread takes
+// the decoded ones over with finish_asset() in the order they finish, to do what only it may, like uploading textures.
+// Finished images go into a resource cache, where everyone who needs one gets it from. An image queued more than once is only loaded once.
+enum AssetType {
+    ASSET_IMAGE, // A BMP or PNG file decoded into a surface.
+    ASSET_MAP // A map loaded as a whole, with its index built.
+};
 
-// draw a rectangle of size l by k
-void DrawRectangle(SDL_Surface *screen, int x, int y, int l, int k, Uint32 outlineColor, Uint32 fillColor) {
-	DrawLine(screen, x, y, k, 0, 1, outlineColor); // Left side
-	DrawLine(screen, x + l - 1, y, k, 0, 1, outlineColor); // Right side
-	DrawLine(screen, x, y, l, 1, 0, outlineColor); // Top side
-	DrawLine(screen, x, y + k - 1, l, 1, 0, outlineColor); // Bottom side
-	for (int i = y + 1; i < y + k - 1; i++) DrawLine(screen, x + 1, i, l - 2, 1, 0, fillColor);
-}
+struct Asset {
+    int type;
+    const char *path;
+    Uint32 format; // Pixel format an image gets converted to right after decoding, on the loader thread. 0 keeps the file's.
+    SDL_Surface *surface; // The decoded image, NULL if it couldn't be loaded. Handed over to the resource cache once finished.
+    Map *map; // Where a map gets loaded to.
+    double load_ms; // Time spent loading on the loader thread.
+};
 
+struct AssetLoader {
+    Asset assets[ASSETS_MAX];
+    int count;
+    SDL_atomic_t next; // Next asset for a thread to pick up.
+    int loaded[ASSETS_MAX]; // Assets loaded so far, in the order they finished.
+    int loaded_count, finished_count; // Number of them loaded, and taken over by finish_asset().
+    SDL_mutex *lock; // Guards loaded and loaded_count.
+    SDL_sem *ready; // Posted once for every loaded asset.
+    SDL_Thread *threads[ASSET_THREADS_MAX];
+    int threads_count;
+    Uint64 start;
+};
 
-double** load_map() {
-    int length, height, number_of_segments, fscanf_status;
-    double **data;
-    FILE *fptr;
-    fptr = fopen("./map/platforms.txt","r");
-    fscanf(fptr, "%d %d", &length, &height);
-    fscanf(fptr, "%d", &number_of_segments);
-    data = (double**)malloc((2 + number_of_segments)*sizeof(double*));
-    data[0] = (double*)malloc(4*sizeof(double)); // TODO: Remove 4 if possible
-    data[0][0] = (double)length;
-    data[0][1] = (double)height;
-    data[1] = (double*)malloc(4*sizeof(double)); // TODO: Remove 4 if possible
-    data[1][0] = (double)number_of_segments;
-    for (int i = 0; i < number_of_segments; i++) {
-        data[i+2] = (double*)malloc(4*sizeof(double));
-        fscanf_status = fscanf(fptr, "%lf %lf %lf %lf", &data[i+2][0], &data[i+2][1], &data[i+2][2], &data[i+2][3]);
-        if (fscanf_status != 4) { // We use the number of matches fscanf() returns to make sure we read exactly 4 number in each line.
-            SDL_Log("Error reading the map file! Incorrect data in line %d!", i+3);
-            fclose(fptr);
-            exit(1);
-        }
+// Queue a file to be loaded by the threads started with start_asset_loader(). Returns the asset's number.
+int queue_asset(AssetLoader *loader, int type, const char *path, Uint32 format, Map *map) {
+    for (int i = 0; i < loader->count; i++) {
+        Asset *queued = &loader->assets[i];
+        if (type == ASSET_IMAGE && queued->type == ASSET_IMAGE && queued->format == format && strcmp(queued->path, path) == 0) return i;
     }
+    if (loader->count == ASSETS_MAX) {
+        SDL_Log("Too many assets, not loading %s.", path);
+        return -1;
+    }
+    Asset *asset = &loader->assets[loader->count];
+    *asset = {};
+    asset->type = type;
+    asset->path = path;
+    asset->format = format;
+    asset->map = map;
+    return loader->count++;
+}
 
-    fgetc(fptr); // as scanf() leaves endlines in the buffer, we need to get rid of the end of the last line containing data
-    if (!((fgetc(fptr) == '\n') || feof(fptr))) { // Now we check if the file ends either with an empty line or just after the end of the last line of data.
-        SDL_Log("Error reading the map file! The file contains more lines than declared!"); // If there is anything besides that at the end of the file, we raise alarm.
-        fclose(fptr);
-        exit(1);
+int asset_loader_thread(void *data) {
+    AssetLoader *loader = (AssetLoader*)data;
+    int i;
+    while ((i = SDL_AtomicAdd(&loader->next, 1)) < loader->count) {
+        Asset *asset = &loader->assets[i];
+        Uint64 start = SDL_GetPerformanceCounter();
+        if (asset->type == ASSET_MAP) {
+            load_map(asset->path, asset->map);
+            build_map_index(&asset->map->index, asset->map->length, asset->map->elements_count, asset->map->elements);
+        } else {
+            asset->surface = IMG_Load(asset->path);
+            if (asset->surface == NULL) SDL_Log("Error loading %s: %s", asset->path, IMG_GetError()); // Errors are kept per thread.
+            else if (asset->format != 0) {
+                SDL_Surface *converted = SDL_ConvertSurfaceFormat(asset->surface, asset->format, 0);
+                SDL_FreeSurface(asset->surface);
+                asset->surface = converted;
+            }
+        }
+        asset->load_ms = (double)(SDL_GetPerformanceCounter() - start) * 1000. / SDL_GetPerformanceFrequency();
+        SDL_LockMutex(loader->lock);
+        loader->loaded[loader->loaded_count++] = i;
+        SDL_UnlockMutex(loader->lock);
+        SDL_SemPost(loader->ready);
     }
-    fclose(fptr);
-    return data;
+    return 0;
 }
 
-double** load_fairies () {}
+// Start loading the queued assets on the given number of threads, 0 = one per core, but never more than there are assets.
+void start_asset_loader(AssetLoader *loader, int threads_count) {
+    if (threads_count <= 0) threads_count = SDL_GetCPUCount();
+    loader->threads_count = SDL_min(SDL_min(threads_count, ASSET_THREADS_MAX), loader->count);
+    SDL_AtomicSet(&loader->next, 0);
+    loader->loaded_count = loader->finished_count = 0;
+    loader->lock = SDL_CreateMutex();
+    loader->ready = SDL_CreateSemaphore(0);
+    loader->start = SDL_GetPerformanceCounter();
+    for (int t = 0; t < loader->threads_count; t++) loader->threads[t] = SDL_CreateThread(asset_loader_thread, "assets", loader);
+}
 
-double** load_stars () {}
+bool assets_pending(AssetLoader *loader) {
+    return loader->finished_count < loader->count;
+}
 
-void draw_map (SDL_Surface *screen, double map_offset, double vertical_map_offset, double map_length, int map_elements_count, double **map_elements, Uint32 outline_color, Uint32 fill_color) {
-    int x;
-    for (int i = 0; i < map_elements_count; i++) { // For each map element there is
-        if (map_elements[i][0] < SCREEN_WIDTH && map_offset >= map_length - SCREEN_WIDTH) { // If it is one of the elements that fit within the first segment of map of length equal to screen width AND we're drawing the region of the map when map looping occurs
-            x = map_elements[i][0] - map_offset + map_length; // Then let's cheat a little and say it lies beneath the map.
-        }
-        else x = (map_elements[i][0] - map_offset);
+// Take over the next asset that's done loading, waiting up to timeout ms for one, putting an image into the cache. Returns NULL if none got done in time.
+Asset* finish_asset(AssetLoader *loader, ResourceCache *cache, Uint32 timeout) {
+    if (!assets_pending(loader) || SDL_SemWaitTimeout(loader->ready, timeout) != 0) return NULL;
+    SDL_LockMutex(loader->lock);
+    Asset *asset = &loader->assets[loader->loaded[loader->finished_count++]];
+    SDL_UnlockMutex(loader->lock);
+    cache_surface(cache, asset->path, asset->format, asset->surface);
+    asset->surface = NULL;
+    SDL_Log("Loaded %s in %.1f ms, done %.1f ms after startup.", asset->path, asset->load_ms,
+        (double)(SDL_GetPerformanceCounter() - loader->start) * 1000. / SDL_GetPerformanceFrequency());
+    return asset;
+}
 
-        if ((x <= SCREEN_WIDTH && x >= 0) // Left edge of the platform is within the screen
-        || (x + map_elements[i][2] <= SCREEN_WIDTH && x + map_elements[i][2] >= 0) // Right edge of the platform is within the screen
-        ) {
-            // TODO: Modify this once the vertical offset is added
-            DrawRectangle(screen, x, map_elements[i][1] - vertical_map_offset, map_elements[i][2], map_elements[i][3], outline_color, fill_color);
-        }
-    }
+// Once every asset has been finished, or to give up on the rest, whose images get freed. Does nothing unless the loader is running.
+void stop_asset_loader(AssetLoader *loader) {
+    if (loader->ready == NULL) return;
+    for (int t = 0; t < loader->threads_count; t++) SDL_WaitThread(loader->threads[t], NULL);
+    for (int i = loader->finished_count; i < loader->loaded_count; i++) SDL_FreeSurface(loader->assets[loader->loaded[i]].surface);
+    SDL_DestroySemaphore(loader->ready);
+    SDL_DestroyMutex(loader->lock);
+    loader->ready = NULL;
+    loader->lock = NULL;
+    SDL_Log("Loaded %d assets in %.1f ms on %d threads.", loader->count,
+        (double)(SDL_GetPerformanceCounter() - loader->start) * 1000. / SDL_GetPerformanceFrequency(), loader->threads_count);
 }
 
 class Unicorn {
@@ -149,7 +2253,7 @@ class Unicorn {
         bool sprite_phase, dashing;
         int dash_timer, sprite_timer; // Number of ticks since dashing started.
         SDL_Surface *spriteA_bmp = NULL, *spriteB_bmp = NULL;
-        SDL_Texture *sprite_tex = NULL;
+        int spriteA_frame = -1, spriteB_frame = -1; // Frames of the sprites within the sprite atlas.
 
     public:
         int lives, width, height;
@@ -157,6 +2261,7 @@ class Unicorn {
         double angle; // Current attitude.
         float x_velocity, y_velocity, y_acc;
         bool on_surface, double_jump_ready;
+        int collision_checks; // Number of platforms examined by the last detect_collisions() call.
         Unicorn() {
             x = DEFAULT_X;
             y = DEFAULT_Y;
@@ -167,29 +2272,41 @@ class Unicorn {
             sprite_phase = false;
             double_jump_ready = true;
             lives = NUMBER_0F_LIVES;
-            dash_length = 50; // The number of ticks the dash lasts.
+            dash_length = DASH_LENGTH;
             sprite_timer = 0;
             sprite_timer_threshold = 3;
-            spriteA_bmp = SDL_LoadBMP("./resources/unicorn-spriteA.bmp");
-            spriteB_bmp = SDL_LoadBMP("./resources/unicorn-spriteB.bmp");
-            width = spriteA_bmp->w;
-            height = spriteA_bmp->h;
+            width = height = 0; // Until the sprites are loaded.
         }
-        int detect_collisions(double map_offset, double vertical_map_offset, double map_length, double map_height, double map_elements_count, double **map_elements);
+        void set_sprites(SDL_Surface *spriteA, SDL_Surface *spriteB);
+        int detect_collisions(double map_offset, double vertical_map_offset, Map *map);
         bool die (int altitude);
         void reset();
         void jump();
         void dash();
         bool dashing_status();
         double dash_offset();
-        SDL_Texture* sprite(SDL_Renderer* renderer);
+        void add_sprites(SpriteAtlas *atlas);
+        int sprite();
 } player;
 
-SDL_Texture* Unicorn::sprite(SDL_Renderer* renderer) {
-    if (!on_surface) return SDL_CreateTextureFromSurface(renderer, spriteB_bmp);
-    else if (sprite_phase) sprite_tex = SDL_CreateTextureFromSurface(renderer, spriteA_bmp);
-    else sprite_tex = SDL_CreateTextureFromSurface(renderer, spriteB_bmp);
-    return sprite_tex;
+// The unicorn is as big as its sprites, which are loaded with the other assets at startup.
+void Unicorn::set_sprites(SDL_Surface *spriteA, SDL_Surface *spriteB) {
+    spriteA_bmp = spriteA;
+    spriteB_bmp = spriteB;
+    width = spriteA->w;
+    height = spriteA->h;
+}
+
+void Unicorn::add_sprites(SpriteAtlas *atlas) {
+    spriteA_frame = add_to_atlas(atlas, spriteA_bmp);
+    spriteB_frame = add_to_atlas(atlas, spriteB_bmp);
+}
+
+// Atlas frame to draw the player with right now.
+int Unicorn::sprite() {
+    if (!on_surface) return spriteB_frame;
+    else if (sprite_phase) return spriteA_frame;
+    else return spriteB_frame;
 }
 
 bool Unicorn::die(int altitude) {
@@ -243,14 +2360,17 @@ double Unicorn::dash_offset() {
     return sin(dash_timer / dash_length * M_PI) * 15;
 }
 
-int Unicorn::detect_collisions(double map_offset, double vertical_map_offset, double map_length, double map_height, double map_elements_count, double **map_elements) {
+int Unicorn::detect_collisions(double map_offset, double vertical_map_offset, Map *map) {
     // Return values:
     // 0 = no collision
     // 1 = standing on a platform
     // 2 = lethal collision
     // 3 = lethal collision and no more lives
+    ProfileScope scope(STAGE_COLLISIONS);
     bool gameover = false;
+    double map_length = map->length, map_height = map->height;
     on_surface = false;
+    collision_checks = 0;
 
     if (y - height/2 > map_height) { // Falling off the map.
         // y = 200; // Add some altitude for a chance to encounter a platform under our hooves when respawning.
@@ -271,39 +2391,20 @@ int Unicorn::detect_collisions(double map_offset, double vertical_map_offset, do
         }
     }
 
-    for (int i = 0; i < map_elements_count; i++) { // Check each and every element of the entire map
-        bool horizontal_collision_condition = false, vertical_collision_condition = false;
-        int platform_x;
-
-        if (map_elements[i][0] < SCREEN_WIDTH && map_offset >= map_length - SCREEN_WIDTH) { // If it is one of the elements that fit within the first segment of map of length equal to screen width AND we're drawing the region of the map when map looping occurs
-            platform_x = map_elements[i][0] - map_offset + map_length; // Then let's cheat a little and say it lies beneath the map.
-        }
-        else platform_x = (map_elements[i][0] - map_offset);
-
-        // Check for deadly collisions
-        if (
-        (x + 0.4*width >= platform_x && x + 0.4*width <= platform_x + map_elements[i][2]) // IF the right edge of the player sprite is within the horizontal span of the platform
-        || // AND/OR
-        (x - 0.4*width >= platform_x && x - 0.4*width <= platform_x + map_elements[i][2]) // the right edge of the player sprite is within the horizontal span of the platform
-        ) horizontal_collision_condition = true;
+    ArenaScope scratch(&frame_arena);
+    double **nearby = (double**)arena_alloc(&frame_arena, MAX_QUERY_RESULTS * sizeof(double*));
+    int nearby_count = nearby != NULL ? query_map(map, map_offset + x - width, map_offset + x + width, nearby, MAX_QUERY_RESULTS) : 0; // Only the platforms around the player can touch them.
+    collision_checks = nearby_count;
+    for (int n = 0; n < nearby_count; n++) { // Check each element near the player
+        double *element = nearby[n];
+        int contact = platform_contact(x, y, width, height, map_offset, map_length, element[0], element[1], element[2], element[3]);
 
-        if (
-        (map_elements[i][1] >= y - 0.4*height && map_elements[i][1] <= y + 0.35*height)
-        ||
-        (map_elements[i][1] + map_elements[i][3] >= y - 0.4*height && map_elements[i][1] + map_elements[i][3] <= y + 0.35*height)
-        ) vertical_collision_condition = true;
-
-        if (vertical_collision_condition && horizontal_collision_condition) {
+        if (contact == 2) {
             return 2 + die(y);
         }
 
-        // Check for bottom contact (i.e. if the unicorn stands on a platform)
-        if (x + 0.4 * width >= platform_x
-        && x - 0.4 * width <= platform_x + map_elements[i][2]
-        && y + height/2 >= map_elements[i][1]
-        && y + height/2 <= map_elements[i][1] + map_elements[i][3]
-        ) {
-            y = map_elements[i][1] - height/2;
+        if (contact == 1) { // Standing on the platform.
+            y = element[1] - height/2;
             y_velocity = 0;
             on_surface = true;
             double_jump_ready = true;
@@ -328,68 +2429,1000 @@ void new_game (Unicorn *player, double *map_offset) {
     return;
 }
 
+// Player inputs. Key presses are turned into these and applied at the start of the next tick, which makes them easy to record and replay.
+enum InputAction {
+    ACTION_NEW_GAME, // N
+    ACTION_TOGGLE_CHEATS, // D
+    ACTION_UP, // Up arrow
+    ACTION_DOWN, // Down arrow
+    ACTION_JUMP, // Z pressed
+    ACTION_JUMP_RELEASE, // Z released
+    ACTION_DASH, // X
+    ACTION_OTHER_KEY // Any other key pressed or released, which stops moving in cheater's controls.
+};
+
+// A recorded run: a header, then for every tick the actions applied before it (one byte each) followed by INPUT_LOG_TICK_END
+// and the state checksum after it (4 bytes).
+struct InputLogHeader {
+    char magic[8]; // INPUT_LOG_MAGIC, zero-padded.
+    Uint32 version; // INPUT_LOG_VERSION
+    Uint32 map_elements_count; // Map the run was recorded on, to catch replays on a different one.
+    double map_length, map_height;
+    Uint8 cheaters_controls; // Controls at the start of the run.
+    Uint8 padding[7];
+};
+
+// Recording or replay of a run.
+struct InputLog {
+    FILE *record; // Non-NULL while recording.
+    Uint8 *data; // The whole recorded file while replaying, NULL otherwise.
+    size_t size, position;
+    bool finished; // Replay has run out of ticks.
+    long long divergences, first_divergence; // Ticks whose state checksum didn't match the recording.
+};
+
+// Game state other than the player, i.e. everything a tick needs besides the Unicorn.
+struct Game {
+    Map *map;
+    double map_offset, vertical_map_offset;
+    bool cheaters_controls;
+    bool restarted; // A new game was started by the last tick.
+    int collision_status; // Last value returned by detect_collisions().
+    long long ticks, collision_checks; // Totals since the start, for statistics.
+    Uint8 pending_actions[MAX_PENDING_ACTIONS]; // Inputs waiting for the next tick.
+    int pending_actions_count;
+    InputLog *input_log; // NULL unless recording or replaying.
+    EntityPool *entities; // Fairies and stars, NULL if none.
+};
+
+// Queue an input for the next tick.
+void queue_action(Game *game, int action) {
+    if (game->pending_actions_count == MAX_PENDING_ACTIONS) return; // Nobody presses that many keys between two ticks.
+    game->pending_actions[game->pending_actions_count++] = action;
+}
+
+void apply_action(Game *game, Unicorn *player, int action) {
+    switch (action) {
+        case ACTION_NEW_GAME:
+            new_game(player, &game->map_offset);
+            if (game->entities != NULL) reset_entities(game->entities);
+            game->restarted = true;
+            break;
+        case ACTION_TOGGLE_CHEATS: toggle_cheaters_controls(&game->cheaters_controls, player); break;
+        case ACTION_UP: if (game->cheaters_controls) player->y_velocity = -6.0; break;
+        case ACTION_DOWN: if (game->cheaters_controls) player->y_velocity = 6.0; break;
+        case ACTION_JUMP:
+            if (game->cheaters_controls) player->y_velocity = 0.;
+            else player->jump();
+            break;
+        case ACTION_JUMP_RELEASE:
+            if (game->cheaters_controls) player->y_velocity = 0.;
+            else player->y_acc = 0.;
+            break;
+        case ACTION_DASH:
+            if (game->cheaters_controls) player->y_velocity = 0.;
+            else player->dash();
+            break;
+        case ACTION_OTHER_KEY: if (game->cheaters_controls) player->y_velocity = 0.; break;
+    }
+}
+
+// FNV-1a hash of the state a replay has to reproduce exactly.
+Uint32 state_checksum(Game *game, Unicorn *player) {
+    Uint8 state[sizeof(float) * 4 + sizeof(int) * 3 + sizeof(double)];
+    int collected = game->entities != NULL ? game->entities->collected : 0, destroyed = game->entities != NULL ? game->entities->destroyed : 0;
+    Uint32 hash = 2166136261u;
+    memcpy(state, &player->x, sizeof(float));
+    memcpy(state + sizeof(float), &player->y, sizeof(float));
+    memcpy(state + sizeof(float) * 2, &player->x_velocity, sizeof(float));
+    memcpy(state + sizeof(float) * 3, &player->y_velocity, sizeof(float));
+    memcpy(state + sizeof(float) * 4, &player->lives, sizeof(int));
+    memcpy(state + sizeof(float) * 4 + sizeof(int), &game->map_offset, sizeof(double));
+    memcpy(state + sizeof(float) * 4 + sizeof(int) + sizeof(double), &collected, sizeof(int));
+    memcpy(state + sizeof(float) * 4 + sizeof(int) * 2 + sizeof(double), &destroyed, sizeof(int));
+    for (size_t i = 0; i < sizeof(state); i++) hash = (hash ^ state[i]) * 16777619u;
+    return hash;
+}
+
+// Start recording the run into the given file.
+bool start_recording(InputLog *log, const char *path, Game *game) {
+    InputLogHeader header;
+    memset(log, 0, sizeof(*log));
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, INPUT_LOG_MAGIC, sizeof(header.magic));
+    header.version = INPUT_LOG_VERSION;
+    header.map_elements_count = game->map->elements_count;
+    header.map_length = game->map->length;
+    header.map_height = game->map->height;
+    header.cheaters_controls = game->cheaters_controls;
+    log->record = fopen(path, "wb");
+    if (log->record == NULL || fwrite(&header, sizeof(header), 1, log->record) != 1) {
+        SDL_Log("Error recording the run into %s!", path);
+        if (log->record != NULL) fclose(log->record);
+        log->record = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Load a recorded run for replaying. The game starts with the controls it was recorded with.
+bool start_replay(InputLog *log, const char *path, Game *game) {
+    InputLogHeader *header;
+    memset(log, 0, sizeof(*log));
+    SDL_RWops *file = SDL_RWFromFile(path, "rb");
+    if (file == NULL) {
+        SDL_Log("Error reading the replay! Cannot open %s!", path);
+        return false;
+    }
+    log->size = SDL_RWsize(file);
+    log->data = (Uint8*)SDL_malloc(log->size > 0 ? log->size : 1);
+    bool ok = log->size >= sizeof(InputLogHeader) && SDL_RWread(file, log->data, log->size, 1) == 1;
+    SDL_RWclose(file);
+    header = (InputLogHeader*)log->data;
+    if (!ok || strncmp(header->magic, INPUT_LOG_MAGIC, sizeof(header->magic)) != 0 || header->version != INPUT_LOG_VERSION) {
+        SDL_Log("Error reading the replay! %s is not a recorded run of this version of the game!", path);
+        SDL_free(log->data);
+        log->data = NULL;
+        return false;
+    }
+    if (header->map_elements_count != (Uint32)game->map->elements_count || header->map_length != game->map->length || header->map_height != game->map->height) {
+        SDL_Log("Error reading the replay! %s was recorded on a different map!", path);
+        SDL_free(log->data);
+        log->data = NULL;
+        return false;
+    }
+    game->cheaters_controls = header->cheaters_controls;
+    log->position = sizeof(InputLogHeader);
+    log->first_divergence = -1;
+    return true;
+}
+
+void stop_input_log(InputLog *log) {
+    if (log->record != NULL) fclose(log->record);
+    SDL_free(log->data);
+    memset(log, 0, sizeof(*log));
+}
+
+// Advance the game by a single tick: apply the inputs, scroll the map, move the player and check for collisions.
+// When replaying, the inputs come from the recording instead of the queue, and the resulting state is checked against it.
+void game_tick(Game *game, Unicorn *player) {
+    double map_length = game->map->length, map_height = game->map->height;
+    InputLog *log = game->input_log;
+    game->restarted = false;
+    if (log != NULL && log->data != NULL) {
+        if (log->position + 1 + sizeof(Uint32) > log->size) {
+            log->finished = true;
+            return;
+        }
+        while (log->position < log->size && log->data[log->position] != INPUT_LOG_TICK_END) apply_action(game, player, log->data[log->position++]);
+        log->position++; // INPUT_LOG_TICK_END
+    } else {
+        for (int i = 0; i < game->pending_actions_count; i++) {
+            apply_action(game, player, game->pending_actions[i]);
+            if (log != NULL && log->record != NULL) fputc(game->pending_actions[i], log->record);
+        }
+    }
+    game->pending_actions_count = 0;
+
+    player->x_velocity = STARTING_X_VELOCITY * (1. + player->dashing_status() * 0.8); // Plus maybe later add acceleration over time.
+    game->map_offset += player->x_velocity;
+    if (game->map_offset >= map_length) {
+        game->map_offset = fmod(game->map_offset, map_length);
+    }
+    if (game->map->stream != NULL) update_map_stream(game->map->stream, game->map_offset);
+    player->x = DEFAULT_X + player->dash_offset();
+    if (player->dashing_status()) player->y_velocity = 0;
+    else player->y += player->y_velocity;
+    if (game->cheaters_controls && player->y <= player->height/2) player->y = player->height/2;
+    if (game->cheaters_controls && player->y + player->height/2 >= map_height) player->y = map_height - player->height/2;
+    if (!game->cheaters_controls && !player->on_surface) {
+        player->y_velocity = fmin(DRAG, player->y_velocity + GRAVITY + player->y_acc);
+        if (player->y_velocity <= -(JUMP_STRENGTH * (1 + 0.3 * player->double_jump_ready))) player->y_acc = 0.; // If max velocity increase due to jumping achieved, stop accelerating. Multiplication by 1.3 to make the first jump a bit stronger than the second one.
+    }
+    player->angle = player->y_velocity / ((GRAVITY + DRAG) / 2) * 15;
+    if (!game->cheaters_controls) {
+        game->collision_status = player->detect_collisions(game->map_offset, game->vertical_map_offset, game->map);
+        game->collision_checks += player->collision_checks;
+    }
+    if (game->entities != NULL) {
+        update_entities(game->entities, game->map_offset, map_length);
+        if (!game->cheaters_controls && game->collision_status < 2
+        && collide_entities(game->entities, game->map_offset, map_length, player->x, player->y, player->width, player->height, player->dashing_status()) == 2) {
+            game->collision_status = 2 + player->die(player->y); // Crashed into a star.
+        }
+    }
+    // TODO Handle collision status
+    game->ticks++;
+
+    if (log != NULL) {
+        Uint32 checksum = state_checksum(game, player), recorded;
+        if (log->record != NULL) {
+            fputc(INPUT_LOG_TICK_END, log->record);
+            fwrite(&checksum, sizeof(checksum), 1, log->record);
+        } else if (log->data != NULL && log->position + sizeof(Uint32) <= log->size) {
+            memcpy(&recorded, log->data + log->position, sizeof(Uint32));
+            log->position += sizeof(Uint32);
+            if (recorded != checksum) {
+                if (log->divergences++ == 0) {
+                    log->first_divergence = game->ticks;
+                    SDL_Log("Replay diverged from the recording at tick %lld!", game->ticks);
+                }
+            }
+        }
+    }
+}
+
+// qsort() comparator for doubles in ascending order.
+int compare_doubles(const void *a, const void *b) {
+    double first = *(const double*)a, second = *(const double*)b;
+    return (first > second) - (first < second);
+}
+
+// Run the given number of ticks as fast as possible without any window, then print throughput and per tick timing statistics.
+// Collisions are on; whenever the player runs out of lives a new game starts, so the run can go on for as long as needed.
+// When replaying, the run follows the recording instead and stops early if the recording ends.
+int run_headless(Game *game, Unicorn *player, long long ticks) {
+    bool replaying = game->input_log != NULL && game->input_log->data != NULL;
+    double *tick_times = (double*)SDL_malloc((ticks > 0 ? ticks : 1) * sizeof(double)); // In microseconds.
+    double frequency = SDL_GetPerformanceFrequency(), total = 0;
+    int game_overs = 0, allocations;
+    if (tick_times == NULL) {
+        SDL_Log("Cannot allocate memory for %lld ticks!", ticks);
+        return 1;
+    }
+    if (!replaying) game->cheaters_controls = false;
+    allocations = allocations_count();
+    for (long long t = 0; t < ticks; t++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        {
+            ProfileScope scope(STAGE_TICK);
+            game_tick(game, player);
+        }
+        if (replaying && game->input_log->finished) {
+            ticks = t;
+            break;
+        }
+        if (game->collision_status == 3 && !game->cheaters_controls) {
+            if (!replaying) queue_action(game, ACTION_NEW_GAME); // Through the queue, so that it gets recorded.
+            game_overs++;
+        }
+        tick_times[t] = (SDL_GetPerformanceCounter() - start) * 1e6 / frequency;
+        total += tick_times[t];
+        drain_profiler();
+    }
+    allocations = allocations_count() - allocations;
+    qsort(tick_times, ticks, sizeof(double), compare_doubles);
+    if (ticks > 0) {
+        printf("ticks: %lld\n", ticks);
+        printf("ticks per second: %.0f\n", ticks / (total * 1e-6));
+        printf("time per tick [us]: mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+            total / ticks, tick_times[ticks / 2], tick_times[ticks * 9 / 10], tick_times[ticks * 99 / 100], tick_times[ticks - 1]);
+        printf("collision checks per tick: %.2f\n", (double)game->collision_checks / ticks);
+        printf("game overs: %d\n", game_overs);
+        printf("heap allocations while ticking: %d\n", allocations);
+    }
+    SDL_free(tick_times);
+    if (replaying) {
+        if (game->input_log->divergences == 0) printf("replay: matches the recording\n");
+        else printf("replay: diverged in %lld ticks, first at tick %lld\n", game->input_log->divergences, game->input_log->first_divergence);
+        return game->input_log->divergences == 0 ? 0 : 2;
+    }
+    return 0;
+}
+
+// Batch simulation: many independent unicorns run through the same map at once, to evaluate levels and bots.
+// The agents don't use the Unicorn class, their physics state is kept in structure-of-arrays form in batches of AGENT_BATCH_SIZE
+// that are stepped in lockstep, following exactly the rules of game_tick() and Unicorn::detect_collisions() with the normal controls.
+struct AgentBatch {
+    int first_agent, count; // Agents first_agent .. first_agent + count - 1.
+    float x[AGENT_BATCH_SIZE], y[AGENT_BATCH_SIZE], x_velocity[AGENT_BATCH_SIZE], y_velocity[AGENT_BATCH_SIZE], y_acc[AGENT_BATCH_SIZE];
+    double map_offset[AGENT_BATCH_SIZE]; // Every agent scrolls through the map on its own.
+    double distance[AGENT_BATCH_SIZE]; // Total distance run, not wrapped around the map.
+    int lives[AGENT_BATCH_SIZE], deaths[AGENT_BATCH_SIZE], dash_timer[AGENT_BATCH_SIZE];
+    long long ticks[AGENT_BATCH_SIZE]; // Ticks survived.
+    bool on_surface[AGENT_BATCH_SIZE], double_jump_ready[AGENT_BATCH_SIZE], dashing[AGENT_BATCH_SIZE], jump_held[AGENT_BATCH_SIZE];
+    Uint32 rng[AGENT_BATCH_SIZE]; // xorshift32 state driving the agent's inputs.
+};
+
+struct BatchRun;
+
+// A worker of the batch simulation pool. It owns a range of batches and steals half of somebody else's remaining range once its own runs out.
+struct BatchWorker {
+    SDL_atomic_t range; // Next batch to run in the low 16 bits, end of the range in the high 16 bits, so both can be updated with a single CAS.
+    SDL_Thread *thread;
+    BatchRun *run;
+    int id, batches_run, steals;
+};
+
+struct BatchRun {
+    Map *map;
+    int width, height; // Size of the unicorn.
+    long long ticks; // Max number of ticks to run every agent for.
+    AgentBatch *batches;
+    int batches_count;
+    BatchWorker *workers;
+    int workers_count;
+};
+
+void init_agent_batch(AgentBatch *batch, int first_agent, int count, Uint32 seed) {
+    memset(batch, 0, sizeof(*batch));
+    batch->first_agent = first_agent;
+    batch->count = count;
+    for (int i = 0; i < count; i++) {
+        Uint32 h = seed * 0x9E3779B1u ^ (Uint32)(first_agent + i) * 0x85EBCA77u; // Every agent gets its own inputs, whichever worker runs it.
+        h ^= h >> 15;
+        h *= 0xC2B2AE3Du;
+        h ^= h >> 13;
+        batch->rng[i] = h != 0 ? h : 1; // xorshift gets stuck at 0.
+        batch->x[i] = DEFAULT_X;
+        batch->y[i] = DEFAULT_Y;
+        batch->x_velocity[i] = STARTING_X_VELOCITY;
+        batch->lives[i] = NUMBER_0F_LIVES;
+        batch->double_jump_ready[i] = true;
+    }
+}
+
+// Same as Unicorn::die().
+bool agent_die(AgentBatch *batch, int i) {
+    int altitude = batch->y[i];
+    batch->lives[i]--;
+    batch->deaths[i]++;
+    batch->double_jump_ready[i] = true;
+    if (altitude >= 500 && altitude <= 700) batch->y[i] = 800;
+    else batch->y[i] = 600;
+    return batch->lives[i] == 0;
+}
+
+// Randomized bot: holds the jump button for a random while every now and then and dashes once in a blue moon. Same effect as Unicorn::jump() and the like.
+void agent_inputs(AgentBatch *batch, int i) {
+    Uint32 r = xorshift32(&batch->rng[i]);
+    if (batch->jump_held[i]) {
+        if (r % 12 == 0) { // Released.
+            batch->jump_held[i] = false;
+            batch->y_acc[i] = 0.;
+        }
+    } else if (r % 40 == 0) { // Pressed.
+        batch->jump_held[i] = true;
+        if (!batch->dashing[i] && (batch->on_surface[i] || (batch->double_jump_ready[i] && batch->y_acc[i] == 0.))) {
+            if (!batch->on_surface[i]) batch->double_jump_ready[i] = false;
+            batch->y_acc[i] = Y_ACC_CONST;
+            batch->y_velocity[i] = JUMP_INITIAL_PUSH;
+        }
+    }
+    if ((r >> 16) % 400 == 0) { // Dash.
+        batch->dashing[i] = true;
+        batch->dash_timer[i] = 0;
+        batch->double_jump_ready[i] = true;
+    }
+}
+
+// Resolve agent i's collisions against the candidate platforms, given as separate x, y, width and height arrays in platform order.
+// The first pass tests the agent against all of them with no early exit so that it vectorizes; as standing on a platform moves the agent,
+// the platforms from the first contact on are then handled one by one, the same way Unicorn::detect_collisions() does.
+void collide_agent(AgentBatch *batch, int i, BatchRun *run, int count, double *xs, double *ys, double *widths, double *heights, Uint8 *contacts) {
+    double map_offset = batch->map_offset[i], map_length = run->map->length;
+    float x = batch->x[i], y = batch->y[i];
+    int width = run->width, height = run->height, first = count;
+
+    for (int k = 0; k < count; k++) contacts[k] = platform_contact(x, y, width, height, map_offset, map_length, xs[k], ys[k], widths[k], heights[k]);
+    for (int k = 0; k < count; k++) {
+        if (contacts[k] != 0) {
+            first = k;
+            break;
+        }
+    }
+    for (int k = first; k < count; k++) {
+        int contact = platform_contact(x, batch->y[i], width, height, map_offset, map_length, xs[k], ys[k], widths[k], heights[k]);
+        if (contact == 2) {
+            agent_die(batch, i);
+            return;
+        }
+        if (contact == 1) {
+            batch->y[i] = ys[k] - height/2;
+            batch->y_velocity[i] = 0;
+            batch->on_surface[i] = true;
+            batch->double_jump_ready[i] = true;
+        }
+    }
+}
+
+// Gather the platforms the index finds within [from, to] into the candidate arrays. Returns their number.
+int gather_candidates(Map *map, double from, double to, double **nearby, double *xs, double *ys, double *widths, double *heights) {
+    int count = query_map(map, from, to, nearby, MAX_QUERY_RESULTS);
+    for (int k = 0; k < count; k++) {
+        xs[k] = nearby[k][0];
+        ys[k] = nearby[k][1];
+        widths[k] = nearby[k][2];
+        heights[k] = nearby[k][3];
+    }
+    return count;
+}
+
+// Run a single tick of every agent still alive in the batch. Returns the number of agents still alive.
+int step_agent_batch(BatchRun *run, AgentBatch *batch) {
+    double *nearby[MAX_QUERY_RESULTS], xs[MAX_QUERY_RESULTS], ys[MAX_QUERY_RESULTS], widths[MAX_QUERY_RESULTS], heights[MAX_QUERY_RESULTS];
+    Uint8 contacts[MAX_QUERY_RESULTS];
+    double map_length = run->map->length, map_height = run->map->height, from = INFINITY, to = -INFINITY;
+    int width = run->width, height = run->height, alive = 0, count = -1;
+    bool colliding[AGENT_BATCH_SIZE];
+
+    for (int i = 0; i < batch->count; i++) { // Movement, same as game_tick().
+        colliding[i] = false;
+        if (batch->lives[i] <= 0) continue;
+        agent_inputs(batch, i);
+        batch->x_velocity[i] = STARTING_X_VELOCITY * (1. + batch->dashing[i] * 0.8);
+        batch->map_offset[i] += batch->x_velocity[i];
+        if (batch->map_offset[i] >= map_length) batch->map_offset[i] = fmod(batch->map_offset[i], map_length);
+        batch->distance[i] += batch->x_velocity[i];
+        batch->x[i] = DEFAULT_X + sin(batch->dash_timer[i] / DASH_LENGTH * M_PI) * 15;
+        if (batch->dashing[i]) batch->y_velocity[i] = 0;
+        else batch->y[i] += batch->y_velocity[i];
+        if (!batch->on_surface[i]) {
+            batch->y_velocity[i] = fmin(DRAG, batch->y_velocity[i] + GRAVITY + batch->y_acc[i]);
+            if (batch->y_velocity[i] <= -(JUMP_STRENGTH * (1 + 0.3 * batch->double_jump_ready[i]))) batch->y_acc[i] = 0.;
+        }
+        batch->ticks[i]++;
+
+        batch->on_surface[i] = false; // Collisions, up to the platform tests, same as Unicorn::detect_collisions().
+        if (batch->y[i] - height/2 > map_height) {
+            agent_die(batch, i);
+            continue;
+        }
+        if (batch->dashing[i]) {
+            batch->dash_timer[i] += 1;
+            if (batch->dash_timer[i] > DASH_LENGTH) {
+                batch->dashing[i] = false;
+                batch->dash_timer[i] = 0;
+            }
+        }
+        colliding[i] = true;
+        from = fmin(from, batch->map_offset[i] + batch->x[i] - width);
+        to = fmax(to, batch->map_offset[i] + batch->x[i] + width);
+    }
+
+    if (to - from <= AGENT_SHARED_QUERY_SPAN) count = gather_candidates(run->map, from, to, nearby, xs, ys, widths, heights); // Agents close together: one query covers all of them.
+    for (int i = 0; i < batch->count; i++) {
+        if (!colliding[i]) continue;
+        if (count < 0 || count == MAX_QUERY_RESULTS) { // Agents spread out: each one queries the stretch around themselves.
+            double position = batch->map_offset[i] + batch->x[i];
+            collide_agent(batch, i, run, gather_candidates(run->map, position - width, position + width, nearby, xs, ys, widths, heights), xs, ys, widths, heights, contacts);
+            count = -1;
+        }
+        else collide_agent(batch, i, run, count, xs, ys, widths, heights, contacts);
+    }
+    for (int i = 0; i < batch->count; i++) alive += batch->lives[i] > 0;
+    return alive;
+}
+
+// Claim the next batch of the worker's own range. Returns -1 if the range is used up.
+int pop_batch(BatchWorker *worker) {
+    while (true) {
+        int range = SDL_AtomicGet(&worker->range), next = range & 0xFFFF, end = (Uint32)range >> 16;
+        if (next >= end) return -1;
+        if (SDL_AtomicCAS(&worker->range, range, (int)((Uint32)end << 16 | (next + 1)))) return next;
+    }
+}
+
+// Take the back half of another worker's remaining range, run the first stolen batch right away and make the rest the worker's own range.
+// Returns the batch to run, or -1 if there's nothing left anywhere.
+int steal_batches(BatchWorker *worker) {
+    BatchRun *run = worker->run;
+    for (int v = 1; v < run->workers_count; v++) {
+        BatchWorker *victim = &run->workers[(worker->id + v) % run->workers_count];
+        while (true) {
+            int range = SDL_AtomicGet(&victim->range), next = range & 0xFFFF, end = (Uint32)range >> 16, taken = (end - next + 1) / 2;
+            if (next >= end) break;
+            if (!SDL_AtomicCAS(&victim->range, range, (int)((Uint32)(end - taken) << 16 | next))) continue; // The victim or another thief got there first.
+            SDL_AtomicSet(&worker->range, (int)((Uint32)end << 16 | (end - taken + 1)));
+            worker->steals++;
+            return end - taken;
+        }
+    }
+    return -1;
+}
+
+int batch_worker(void *data) {
+    BatchWorker *worker = (BatchWorker*)data;
+    int b;
+    while ((b = pop_batch(worker)) >= 0 || (b = steal_batches(worker)) >= 0) {
+        AgentBatch *batch = &worker->run->batches[b];
+        for (long long t = 0; t < worker->run->ticks; t++) {
+            if (step_agent_batch(worker->run, batch) == 0) break; // Everybody's out of lives.
+        }
+        worker->batches_run++;
+    }
+    return 0;
+}
+
+// Run agents_count randomized agents through the map for up to ticks ticks each on threads_count threads (0 = one per core),
+// print every agent's distance and deaths to results (a CSV file, or stdout if NULL) and the aggregate statistics to stdout.
+int run_batch(Map *map, int width, int height, int agents_count, long long ticks, Uint32 seed, int threads_count, const char *results) {
+    BatchRun run;
+    FILE *out = stdout;
+    double seconds, total_distance = 0;
+    long long agent_ticks = 0, total_deaths = 0;
+    int finished = 0;
+    Uint64 start;
+
+    run.map = map;
+    run.width = width;
+    run.height = height;
+    run.ticks = ticks;
+    run.batches_count = (agents_count + AGENT_BATCH_SIZE - 1) / AGENT_BATCH_SIZE;
+    if (run.batches_count > 0xFFFF) {
+        SDL_Log("Too many agents! At most %d fit into a batch simulation.", 0xFFFF * AGENT_BATCH_SIZE);
+        return 1;
+    }
+    run.workers_count = threads_count > 0 ? threads_count : SDL_GetCPUCount();
+    if (run.workers_count > run.batches_count) run.workers_count = run.batches_count > 0 ? run.batches_count : 1;
+    run.batches = (AgentBatch*)SDL_malloc((run.batches_count > 0 ? run.batches_count : 1) * sizeof(AgentBatch));
+    run.workers = (BatchWorker*)SDL_calloc(run.workers_count, sizeof(BatchWorker));
+    if (run.batches == NULL || run.workers == NULL) {
+        SDL_Log("Cannot allocate memory for %d agents!", agents_count);
+        return 1;
+    }
+    for (int b = 0; b < run.batches_count; b++) {
+        int first = b * AGENT_BATCH_SIZE;
+        init_agent_batch(&run.batches[b], first, agents_count - first < AGENT_BATCH_SIZE ? agents_count - first : AGENT_BATCH_SIZE, seed);
+    }
+
+    start = SDL_GetPerformanceCounter();
+    for (int w = 0; w < run.workers_count; w++) { // Every worker starts with an equal share of the batches.
+        BatchWorker *worker = &run.workers[w];
+        worker->run = &run;
+        worker->id = w;
+        SDL_AtomicSet(&worker->range, (int)((Uint32)(run.batches_count * (w + 1) / run.workers_count) << 16 | (run.batches_count * w / run.workers_count)));
+    }
+    for (int w = 1; w < run.workers_count; w++) run.workers[w].thread = SDL_CreateThread(batch_worker, "batch worker", &run.workers[w]);
+    batch_worker(&run.workers[0]); // The main thread pitches in too.
+    for (int w = 1; w < run.workers_count; w++) {
+        if (run.workers[w].thread != NULL) SDL_WaitThread(run.workers[w].thread, NULL);
+        else batch_worker(&run.workers[w]); // Couldn't start the thread, so whatever's left of its range is stolen or run here.
+    }
+    seconds = (SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+
+    if (results != NULL && (out = fopen(results, "w")) == NULL) {
+        SDL_Log("Cannot open %s for writing! Printing the results instead.", results);
+        out = stdout;
+    }
+    fprintf(out, "agent,distance,deaths,ticks\n");
+    for (int b = 0; b < run.batches_count; b++) {
+        AgentBatch *batch = &run.batches[b];
+        for (int i = 0; i < batch->count; i++) {
+            fprintf(out, "%d,%.0f,%d,%lld\n", batch->first_agent + i, batch->distance[i], batch->deaths[i], batch->ticks[i]);
+            total_distance += batch->distance[i];
+            total_deaths += batch->deaths[i];
+            agent_ticks += batch->ticks[i];
+            finished += batch->lives[i] > 0;
+        }
+    }
+    if (out != stdout) fclose(out);
+
+    printf("agents: %d in %d batches on %d threads\n", agents_count, run.batches_count, run.workers_count);
+    printf("agent ticks: %lld in %.3f s\n", agent_ticks, seconds);
+    printf("agent ticks per second: %.0f\n", agent_ticks / seconds);
+    if (agents_count > 0) {
+        printf("mean distance: %.0f\n", total_distance / agents_count);
+        printf("mean deaths: %.2f\n", (double)total_deaths / agents_count);
+        printf("agents still alive after %lld ticks: %d\n", ticks, finished);
+    }
+    for (int w = 0; w < run.workers_count; w++) printf("worker %d: %d batches, %d steals\n", w, run.workers[w].batches_run, run.workers[w].steals);
+    SDL_free(run.batches);
+    SDL_free(run.workers);
+    return 0;
+}
+
+// Rolling statistics of a stage over the samples still in the ring, in microseconds. Returns the number of samples they cover.
+int profile_stats(int stage, double *min, double *average, double *p99) {
+    double durations[PROFILE_RING_SIZE];
+    int head = SDL_AtomicGet(&profiler.head), count = 0;
+    double scale = 1e6 / SDL_GetPerformanceFrequency(), total = 0;
+    ProfileSample sample;
+    for (int n = head > PROFILE_RING_SIZE ? head - PROFILE_RING_SIZE : 0; n < head; n++) {
+        if (read_profile_sample(n, &sample) && sample.stage == stage) {
+            durations[count] = (sample.end - sample.start) * scale;
+            total += durations[count++];
+        }
+    }
+    *min = *average = *p99 = 0;
+    if (count == 0) return 0;
+    qsort(durations, count, sizeof(double), compare_doubles);
+    *min = durations[0];
+    *average = total / count;
+    *p99 = durations[count * 99 / 100];
+    return count;
+}
+
+// The profiler overlay, toggled with P: a line of rolling statistics per stage, refreshed twice a second.
+struct ProfileOverlay {
+    bool visible;
+    TextLine lines[STAGES_COUNT + 1]; // A header, then one line per stage.
+};
+
+void update_profile_overlay(ProfileOverlay *overlay, SDL_Surface *glyphs) {
+    char text[128];
+    double min, average, p99;
+    set_text_line(&overlay->lines[0], "stage           min [us]  avg [us]  p99 [us]  samples", glyphs);
+    for (int s = 0; s < STAGES_COUNT; s++) {
+        int count = profile_stats(s, &min, &average, &p99);
+        sprintf(text, "%-12s %11.1f %9.1f %9.1f %8d", stage_names[s], min, average, p99, count);
+        set_text_line(&overlay->lines[s + 1], text, glyphs);
+    }
+}
+
+// record drawing the profiler overlay below the info panel
+void DrawProfileOverlay(Rasterizer *raster, ProfileOverlay *overlay, Uint32 outlineColor, Uint32 fillColor) {
+    RasterRectangle(raster, 4, 60, overlay->lines[0].width + 16, (STAGES_COUNT + 1) * 12 + 8, outlineColor, fillColor);
+    for (int l = 0; l <= STAGES_COUNT; l++) DrawTextLine(raster, 12, 66 + l * 12, &overlay->lines[l]);
+}
+
+// queue the profiler overlay, looking like DrawProfileOverlay() would draw it
+void BatchProfileOverlay(GeometryBatch *batch, ProfileOverlay *overlay, SDL_Color outlineColor, SDL_Color fillColor) {
+    BatchRectangle(batch, 4, 60, overlay->lines[0].width + 16, (STAGES_COUNT + 1) * 12 + 8, outlineColor, fillColor);
+    for (int l = 0; l <= STAGES_COUNT; l++) BatchTextLine(batch, 12, 66 + l * 12, &overlay->lines[l]);
+}
+
+void free_profile_overlay(ProfileOverlay *overlay) {
+    for (int l = 0; l <= STAGES_COUNT; l++) free_text_line(&overlay->lines[l]);
+}
+
+// How the main loop paces its frames.
+enum PacingMode {
+    PACING_VSYNC, // SDL_RenderPresent() waits for the display's vertical sync.
+    PACING_FPS, // Sleep until the next frame of a target frame rate is due.
+    PACING_UNCAPPED // As many frames as possible, for benchmarking.
+};
+
+// Frame pacing, so that the main loop doesn't draw frames faster than anybody can see them. The game itself runs on the tick scheduler,
+// so its speed doesn't depend on the pacing, only the number of frames drawn in between the ticks does.
+struct FramePacer {
+    int mode;
+    double fps; // Target frame rate of PACING_FPS.
+    Uint64 period, deadline; // Frame period and when the next frame is due, in performance counter units.
+    Uint64 last_frame; // When the previous frame went out.
+    long long frames;
+    double frame_times[FRAME_TIMES_KEPT]; // Time between consecutive frames in ms, the latest FRAME_TIMES_KEPT of them.
+};
+
+// Set up the pacer from a --pacing argument: vsync, uncapped, or a target frame rate. Returns false if the argument makes no sense.
+bool init_frame_pacer(FramePacer *pacer, const char *mode) {
+    memset(pacer, 0, sizeof(*pacer));
+    if (strcmp(mode, "vsync") == 0) pacer->mode = PACING_VSYNC;
+    else if (strcmp(mode, "uncapped") == 0) pacer->mode = PACING_UNCAPPED;
+    else if (atof(mode) > 0) {
+        pacer->mode = PACING_FPS;
+        pacer->fps = atof(mode);
+    }
+    else return false;
+    if (pacer->mode != PACING_FPS) pacer->fps = DEFAULT_PACING_FPS; // In case vsync turns out not to be available.
+    pacer->period = SDL_GetPerformanceFrequency() / pacer->fps;
+    return true;
+}
+
+// Wait until the next frame is due. Call right after presenting a frame.
+// SDL_Delay() can oversleep by a millisecond or two, so it only sleeps until PACING_SPIN_MS before the deadline and busy-waits the rest.
+void pace_frame(FramePacer *pacer) {
+    Uint64 now = SDL_GetPerformanceCounter(), frequency = SDL_GetPerformanceFrequency(), spin = frequency * PACING_SPIN_MS / 1000;
+    if (pacer->mode == PACING_FPS) {
+        if (pacer->deadline == 0 || now > pacer->deadline + pacer->period) pacer->deadline = now; // The first frame, or more than a whole frame late: start over rather than rushing frames out to catch up.
+        pacer->deadline += pacer->period;
+        if (pacer->deadline > now + spin) SDL_Delay((Uint32)((pacer->deadline - now - spin) * 1000 / frequency));
+        while ((now = SDL_GetPerformanceCounter()) < pacer->deadline);
+    }
+    if (pacer->last_frame != 0) pacer->frame_times[pacer->frames++ % FRAME_TIMES_KEPT] = (now - pacer->last_frame) * 1000. / frequency;
+    pacer->last_frame = now;
+}
+
+// Print how evenly the frames went out.
+void report_frame_pacing(FramePacer *pacer) {
+    const char *modes[] = {"vsync", "fps", "uncapped"};
+    int count = pacer->frames < FRAME_TIMES_KEPT ? pacer->frames : FRAME_TIMES_KEPT;
+    double mean = 0, variance = 0, *sorted;
+    if (count == 0) return;
+    for (int f = 0; f < count; f++) mean += pacer->frame_times[f];
+    mean /= count;
+    for (int f = 0; f < count; f++) variance += (pacer->frame_times[f] - mean) * (pacer->frame_times[f] - mean);
+    variance /= count;
+    sorted = (double*)SDL_malloc(count * sizeof(double));
+    memcpy(sorted, pacer->frame_times, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), compare_doubles);
+    printf("frame pacing: %s", modes[pacer->mode]);
+    if (pacer->mode == PACING_FPS) printf(" %.0f (%.3f ms)", pacer->fps, 1000. / pacer->fps);
+    printf(", over the last %d frames\n", count);
+    printf("frame time [ms]: mean %.3f, jitter (std. dev.) %.3f, min %.3f, p50 %.3f, p99 %.3f, max %.3f\n",
+        mean, sqrt(variance), sorted[0], sorted[count / 2], sorted[count * 99 / 100], sorted[count - 1]);
+    SDL_free(sorted);
+}
+
+#ifndef RUA_NO_MAIN // Defined by bench.cpp and tests.cpp, which include this file for everything but main().
 // I'm using classes, so C++ compilation has to be used, but let's remember this trick for later.
 // #ifdef __cplusplus
 // extern "C"
 // #endif
 int main(int argc, char **argv) {
+    count_allocations(); // Before anything gets allocated.
     SDL_Log("Starting Robot Unicorn Attack v1.0"); // Could use printf for logging, but SDL_Log feels so much more professional. ;)
-	int t1, t2, frames, rc, map_elements_count, collision_status = 0;
-	double delta, worldTime, fpsTimer, fps, ticker, map_offset, vertical_map_offset, map_length, map_height, player_sprite_y;
-	double **map_data, **map_elements;
+	int frames, rc, ticks_this_frame;
+	long long headless_ticks = 0, batch_ticks = DEFAULT_BATCH_TICKS;
+	int batch_agents = 0, batch_threads = 0;
+	Uint32 batch_seed = 1;
+	const char *batch_results = NULL;
+	const char *profile_path = NULL;
+	ProfileOverlay profile_overlay = {};
+	FramePacer pacer;
+	const char *pacing = "vsync";
+	const char *record_path = NULL, *replay_path = NULL;
+	InputLog input_log = {};
+	Uint64 t1, t2; // Performance counter readings, ms resolution of SDL_GetTicks() is too coarse for the tick scheduler.
+	double delta, worldTime, fpsTimer, fps, ticker, map_length, map_height, player_sprite_y;
+	double previous_map_offset, previous_x, previous_y, previous_angle; // State as of the previous tick, for interpolation.
+	double alpha, render_map_offset, render_x, render_y, render_angle; // State interpolated between the last two ticks, used for drawing.
+	const char *map_path = DEFAULT_MAP;
+	Map map = {};
+	EntityPool entities = {};
+	Game game = {};
 	SDL_Event event;
-	SDL_Surface *screen, *charset;
-	SDL_Texture *scrtex; // Screen texture.
-	SDL_Window *window;
-	SDL_Renderer *renderer;
+	ResourceCache resources = {}; // The images loaded from disk.
+	SurfaceHandle screen, charset, spriteA, spriteB; // screen and scrtex only exist when there is a window.
+	TextureHandle scrtex; // Screen texture.
+	SDL_Window *window = NULL;
+	SDL_Renderer *renderer = NULL;
 	SDL_Rect player_target_rect, rainbow_target_rect; // Player position where their sprite should be rendered.
 	bool fullscreen = false; // TODO: Load this from config.
-	bool cheaters_controls = true;
 	bool quit = false;
+	bool stream_map = false;
+	bool endless = false;
+	Uint32 endless_seed = 0;
+	bool geometry_backend = false; // Draw with batched renderer geometry instead of software drawing into the screen surface.
+	int raster_threads = 0; // Threads drawing into the screen surface, 0 = one per core.
+	bool incremental = false; // Keep the map drawn from frame to frame and only draw what scrolls into view, with the surface backend.
+	bool check_allocations = false; // Assert that frames don't allocate anything once warmed up.
+	int frame_allocations, platforms_composed; // Counts as of the start of the frame.
+	long long frames_drawn = 0;
+	const char *screenshot_path = NULL;
+	AssetLoader assets = {};
+	SpriteAtlas atlas = {};
+	PlatformCache platforms = {};
+	GeometryBatch batch = {};
+	Rasterizer raster = {};
+	MapLayer map_layer = {};
+	SurfaceHandle glyphs; // The charset in a 32 bit format, for pre-rendering text.
+	TextLine time_line = {}, lives_line = {}, controls_line = {}; // The info panel's text.
 
-	if(SDL_Init(SDL_INIT_EVERYTHING) != 0) {
-		printf("SDL_Init error: %s\n", SDL_GetError());
-		return 1;
-    }
+	// Everything main() sets up is freed here, whichever way it returns. Whatever hasn't been set up yet is still zeroed, which the free functions skip.
+	auto free_everything = [&]() {
+		stop_asset_loader(&assets); // Before anything the loader's threads may still be loading into.
+		if (game.input_log != NULL) stop_input_log(&input_log);
+		stop_profiler();
+		free_entity_pool(&entities);
+		if (map.stream == NULL) free_map_index(&map.index);
+		free_map(&map);
+		free_geometry_batch(&batch);
+		free_rasterizer(&raster);
+		if (map_layer.surface != NULL) free_map_layer(&map_layer);
+		free_platform_cache(&platforms);
+		free_text_line(&time_line);
+		free_text_line(&lives_line);
+		free_text_line(&controls_line);
+		free_profile_overlay(&profile_overlay);
+		free_frame_arena(&frame_arena);
+		atlas.texture = scrtex = TextureHandle(); // Textures go before the renderer they belong to, surfaces with their handles.
+		if (renderer != NULL) SDL_DestroyRenderer(renderer);
+		if (window != NULL) SDL_DestroyWindow(window);
+		IMG_Quit();
+		SDL_Quit();
+	};
+	ScopeExit<decltype(free_everything)> cleanup(free_everything);
 
-	// fullscreen mode disabled for now
-	if (fullscreen) rc = SDL_CreateWindowAndRenderer(0, 0, SDL_WINDOW_FULLSCREEN_DESKTOP, &window, &renderer);
-	else rc = SDL_CreateWindowAndRenderer(SCREEN_WIDTH, SCREEN_HEIGHT, 0, &window, &renderer);
+	// Command line: --compile-map <platforms.txt> <platforms.bin> compiles a map and exits, --map <file> picks the map to play (text or compiled),
+	// --stream streams the (compiled) map from disk chunk by chunk instead of loading it whole,
+	// --renderer surface|geometry picks the render backend (software drawing into a surface uploaded every frame, or batched renderer geometry),
+	// --software-renderer forces SDL's software renderer, --screenshot <file.bmp> saves the first frame and quits, so backends can be compared,
+	// --headless <ticks> runs that many ticks without a window as fast as possible and prints performance statistics,
+	// --record <file> records the inputs of the run, --replay <file> plays a recorded run back (interactively or headless) and checks it plays out the same,
+	// --batch <agents> runs that many randomized bots through the map in parallel and reports how far each got, tuned with --ticks <n> (per agent),
+	// --seed <n> (of the bots' inputs), --threads <n> (0 = one per core) and --batch-out <file.csv> (per agent results, stdout by default),
+	// --profile-out <file.json|file.csv> dumps the profiler's timings of every frame stage as a Chrome trace or CSV file on the way out,
+	// --pacing vsync|<fps>|uncapped waits for the vertical sync (the default), paces the frames to the given frame rate, or draws as many frames as possible,
+	// --endless <seed> plays an endless map generated from the seed instead of a map from disk,
+	// --raster-threads <n> sets how many threads draw into the screen surface with the surface backend (0 = one per core, the default),
+	// --incremental keeps the map drawn between frames with the surface backend, only drawing and uploading the parts that scroll into view,
+	// --check-allocations asserts that no frame allocates anything on the heap once the game has warmed up, except to compose platforms coming into view.
+	for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--compile-map") == 0 && i + 2 < argc) return compile_map(argv[i + 1], argv[i + 2]);
+        else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) map_path = argv[++i];
+        else if (strcmp(argv[i], "--stream") == 0) stream_map = true;
+        else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc) geometry_backend = strcmp(argv[++i], "geometry") == 0;
+        else if (strcmp(argv[i], "--software-renderer") == 0) SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
+        else if (strcmp(argv[i], "--screenshot") == 0 && i + 1 < argc) screenshot_path = argv[++i];
+        else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) headless_ticks = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay_path = argv[++i];
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) batch_agents = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) batch_ticks = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) batch_seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) batch_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--batch-out") == 0 && i + 1 < argc) batch_results = argv[++i];
+        else if (strcmp(argv[i], "--profile-out") == 0 && i + 1 < argc) profile_path = argv[++i];
+        else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) pacing = argv[++i];
+        else if (strcmp(argv[i], "--raster-threads") == 0 && i + 1 < argc) raster_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--incremental") == 0) incremental = true;
+        else if (strcmp(argv[i], "--check-allocations") == 0) check_allocations = true;
+        else if (strcmp(argv[i], "--endless") == 0 && i + 1 < argc) {
+            endless = true;
+            endless_seed = strtoul(argv[++i], NULL, 10);
+        }
+	}
 
-	if(rc != 0) {
-		SDL_Quit();
-		printf("SDL_CreateWindowAndRenderer error: %s\n", SDL_GetError());
+	if (batch_agents > 0 && stream_map) {
+        SDL_Log("Batch simulations need the whole map in memory, ignoring --stream."); // Every agent is somewhere else on the map, while a stream follows a single position.
+        stream_map = false;
+	}
+	if (batch_agents > 0 && endless) {
+        SDL_Log("Batch simulations need the whole map in memory, ignoring --endless."); // Same as above, and an endless map never is whole.
+        endless = false;
+	}
+
+	init_frame_arena(&frame_arena, FRAME_ARENA_BYTES); // Collision detection needs it too, not only drawing.
+
+	// Everything is read from disk on the asset loader's threads, while the window opens. Headless runs and batch simulations only need the unicorn and the map.
+	bool interactive = headless_ticks == 0 && batch_agents == 0;
+	const char *spriteA_path = "./resources/unicorn-spriteA.bmp", *spriteB_path = "./resources/unicorn-spriteB.bmp";
+	const char *charset_path = "./resources/cs8x8.bmp", *rainbow_path = "./resources/rainbow.bmp";
+	char tile_paths[PLATFORM_TILES_COUNT][64];
+	IMG_Init(IMG_INIT_PNG); // Before the loader's threads get to use it.
+	queue_asset(&assets, ASSET_IMAGE, spriteA_path, 0, NULL);
+	queue_asset(&assets, ASSET_IMAGE, spriteB_path, 0, NULL);
+	if (!endless && !stream_map) queue_asset(&assets, ASSET_MAP, map_path, 0, &map);
+	if (interactive) {
+		queue_asset(&assets, ASSET_IMAGE, charset_path, 0, NULL);
+		queue_asset(&assets, ASSET_IMAGE, rainbow_path, 0, NULL);
+		for (int i = 0; i < PLATFORM_TILES_COUNT; i++) { // Converted to ARGB8888 like the screen right away, so that composing platforms is a plain copy.
+			sprintf(tile_paths[i], "./resources/grassy_tile_%d.png", i + 1);
+			queue_asset(&assets, ASSET_IMAGE, tile_paths[i], SDL_PIXELFORMAT_ARGB8888, NULL);
+		}
+	}
+	start_asset_loader(&assets, 0);
+
+	if (interactive) {
+		if(SDL_Init(SDL_INIT_EVERYTHING) != 0) {
+			printf("SDL_Init error: %s\n", SDL_GetError());
+			return 1;
+		}
+
+		if (!init_frame_pacer(&pacer, pacing)) {
+			SDL_Log("Unknown frame pacing %s, using vsync.", pacing);
+			init_frame_pacer(&pacer, "vsync");
+		}
+		SDL_SetHint(SDL_HINT_RENDER_VSYNC, pacer.mode == PACING_VSYNC ? "1" : "0"); // Only has an effect on renderers created afterwards.
+
+		// fullscreen mode disabled for now
+		if (fullscreen) rc = SDL_CreateWindowAndRenderer(0, 0, SDL_WINDOW_FULLSCREEN_DESKTOP, &window, &renderer);
+		else rc = SDL_CreateWindowAndRenderer(SCREEN_WIDTH, SCREEN_HEIGHT, 0, &window, &renderer);
+
+		if(rc != 0) {
+			printf("SDL_CreateWindowAndRenderer error: %s\n", SDL_GetError());
+			return 1;
+		}
+
+		SDL_RendererInfo renderer_info;
+		if (pacer.mode == PACING_VSYNC && (SDL_GetRendererInfo(renderer, &renderer_info) != 0 || !(renderer_info.flags & SDL_RENDERER_PRESENTVSYNC))) {
+			SDL_Log("The renderer cannot wait for vsync, pacing frames to %d FPS instead.", DEFAULT_PACING_FPS);
+			pacer.mode = PACING_FPS;
+		}
+
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+		SDL_RenderSetLogicalSize(renderer, SCREEN_WIDTH, SCREEN_HEIGHT);
+		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+		screen = SurfaceHandle(SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000));
+		scrtex = TextureHandle(SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT));
+
+		SDL_SetWindowTitle(window, "Robot Unicorn Attack");
+		SDL_ShowCursor(SDL_DISABLE); // Hide cursor
+		SDL_RenderClear(renderer); // Show the window right away, before any of the assets are in.
+		SDL_RenderPresent(renderer);
+	}
+
+	// Take the assets over in the order they finish loading. Whatever needs them on the main thread is done right away, e.g. the sprite
+	// atlas is uploaded as soon as its last sprite is in, and the window keeps responding meanwhile. The rainbow is optional: if it can't
+	// be loaded, the atlas is built without it once everything else is in, and the unicorn just dashes without it.
+	int rainbow = -1;
+	while (assets_pending(&assets)) {
+		Asset *asset = finish_asset(&assets, &resources, 10);
+		if (interactive) SDL_PumpEvents();
+		if (asset == NULL) continue;
+		if (strcmp(asset->path, charset_path) == 0 && (charset = cached_surface(&resources, charset_path, 0)) != NULL) {
+			SDL_SetColorKey(charset, true, 0x000000); // sets black as the transparent color for the bitmap loaded to charset
+			glyphs = SurfaceHandle(SDL_ConvertSurfaceFormat(charset, SDL_PIXELFORMAT_RGB888, 0)); // Keeps the color key.
+			if (glyphs != NULL) {
+				set_text_line(&controls_line, "Esc - quit, Z - jump, X - dash, D - toggle cheater's controls, N - new game.", glyphs); // Never changes.
+				if (geometry_backend) text_line_texture(renderer, &controls_line);
+			}
+		}
+		if (strcmp(asset->path, spriteA_path) != 0 && strcmp(asset->path, spriteB_path) != 0 && strcmp(asset->path, rainbow_path) != 0) continue;
+		if (player.width == 0 && (spriteA = cached_surface(&resources, spriteA_path, 0)) != NULL && (spriteB = cached_surface(&resources, spriteB_path, 0)) != NULL) {
+			player.set_sprites(spriteA, spriteB);
+		}
+		SurfaceHandle rainbow_bmp = cached_surface(&resources, rainbow_path, 0);
+		if (interactive && player.width > 0 && rainbow_bmp != NULL && atlas.frames_count == 0) {
+			// Pack all sprites, including the rainbow effect when dashing, into the atlas. The rainbow's surface isn't needed afterwards.
+			rainbow = add_to_atlas(&atlas, rainbow_bmp);
+			player.add_sprites(&atlas);
+			build_sprite_atlas(&atlas, renderer);
+		}
+	}
+	stop_asset_loader(&assets);
+	if (interactive && player.width > 0 && atlas.frames_count == 0) { // The rainbow didn't load.
+		player.add_sprites(&atlas);
+		build_sprite_atlas(&atlas, renderer);
+	}
+	if (interactive) {
+		// Platforms are textured with tiles, composed once per platform and cached as surfaces or textures depending on the backend.
+		// The tiles are added in a fixed order, whichever order they were loaded in, so that platforms always look the same.
+		init_platform_cache(&platforms, geometry_backend ? renderer : NULL);
+		for (int i = 0; i < PLATFORM_TILES_COUNT; i++) add_platform_tile(&platforms, cached_surface(&resources, tile_paths[i], SDL_PIXELFORMAT_ARGB8888).release());
+		if (platforms.tiles_count == 0) SDL_Log("No platform tiles, drawing plain platforms.");
+	}
+	trim_resource_cache(&resources); // Only once everything has taken what it needs. Frees the rainbow's surface, packed into the atlas by now.
+	if (player.width == 0) {
+		SDL_Log("Error loading the unicorn's sprites!");
 		return 1;
+	}
+
+	if (endless) open_endless_stream(endless_seed, player.width, player.height, &map);
+	else if (stream_map) open_map_stream(map_path, &map);
+    map_length = map.length; // Only copy for convenience to have a more reasonable and informative variable name.
+    map_height = map.height; // Same as above.
+    game.map = &map;
+    init_entity_pool(&entities);
+    if (!endless) { // Fairies and stars are placed on the map from disk, an endless map has none.
+        load_fairies(&entities);
+        load_stars(&entities);
+        build_entity_index(&entities, map_length);
+        game.entities = &entities;
     }
+    game.cheaters_controls = headless_ticks == 0; // Headless runs are about collisions, so they start with the normal controls.
+    if (replay_path != NULL || record_path != NULL) {
+        if (replay_path != NULL ? !start_replay(&input_log, replay_path, &game) : !start_recording(&input_log, record_path, &game)) return 1;
+        game.input_log = &input_log;
+    }
+
+	if (batch_agents > 0) return run_batch(&map, player.width, player.height, batch_agents, batch_ticks, batch_seed, batch_threads, batch_results);
 
-	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-	SDL_RenderSetLogicalSize(renderer, SCREEN_WIDTH, SCREEN_HEIGHT);
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    screen = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-	scrtex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+	if (headless_ticks == 0 || profile_path != NULL) start_profiler(profile_path); // Always on when playing, for the overlay.
 
-	SDL_SetWindowTitle(window, "Robot Unicorn Attack");
-	SDL_ShowCursor(SDL_DISABLE); // Hide cursor
+	if (headless_ticks > 0) return run_headless(&game, &player, headless_ticks);
 
-	// load character set bitmap (sorta font)
-	charset = SDL_LoadBMP("./resources/cs8x8.bmp");
+
+	// The character set bitmap (sorta font) and the sprite atlas were prepared while the assets were coming in.
 	if(charset == NULL) {
-		printf("SDL_LoadBMP(cs8x8.bmp) error: %s\n", SDL_GetError());
-		SDL_FreeSurface(screen);
-		SDL_DestroyTexture(scrtex);
-		SDL_DestroyWindow(window);
-		SDL_DestroyRenderer(renderer);
-		SDL_Quit();
+		printf("Error loading cs8x8.bmp!\n");
 		return 1;
     }
-	SDL_SetColorKey(charset, true, 0x000000); // sets black as the transparent color for the bitmap loaded to charset
+	if (glyphs == NULL) {
+		printf("SDL_ConvertSurfaceFormat(cs8x8.bmp) error: %s\n", SDL_GetError());
+		return 1;
+	}
+	if (geometry_backend) init_geometry_batch(&batch, renderer);
+
+	if (atlas.texture == NULL) {
+		printf("Sprite atlas error: %s\n", SDL_GetError());
+		return 1;
+	}
 
-	// Create a texture for the rainbow effect when dashing, then immediately free the surface used to load the bitmap.
-	SDL_Surface *rainbow_surf = SDL_LoadBMP("./resources/rainbow.bmp");
-	SDL_Texture *rainbow = SDL_CreateTextureFromSurface(renderer, rainbow_surf);
-	SDL_FreeSurface(rainbow_surf);
+	if (!geometry_backend) init_rasterizer(&raster, screen, raster_threads);
+	// Incremental drawing: the map goes into its own layer, while the screen surface only gets what's drawn on top of it, on a transparent background.
+	DirtyRects overlay_dirty = {{}, -1}, overlay_current; // All of the screen surface is uploaded on the first frame.
+	int overlay_start = 0;
+	if (incremental && geometry_backend) {
+		SDL_Log("Incremental drawing only works with the surface backend, ignoring --incremental.");
+		incremental = false;
+	}
+	if (incremental) {
+		init_map_layer(&map_layer, renderer, raster_threads);
+		SDL_SetTextureBlendMode(scrtex, SDL_BLENDMODE_BLEND);
+	}
 
-	char text[128];
 	// Declare some shorthands for most useful, common colors.
 	const int color_black = SDL_MapRGB(screen->format, 0x00, 0x00, 0x00);
 	const int color_red = SDL_MapRGB(screen->format, 0xFF, 0x00, 0x00);
@@ -397,150 +3430,230 @@ int main(int argc, char **argv) {
 	const int color_blue = SDL_MapRGB(screen->format, 0x11, 0x11, 0xCC);
 	const int color_white = SDL_MapRGB(screen->format, 0xFF, 0xFF, 0xFF);
 	const int color_brown = SDL_MapRGB(screen->format, 0xA5, 0x2A, 0x2A);
+	const int color_pink = SDL_MapRGB(screen->format, 0xFF, 0x69, 0xB4);
+	const int color_yellow = SDL_MapRGB(screen->format, 0xFF, 0xD7, 0x00);
 
-	map_data = load_map();
-    map_length = map_data[0][0]; // Only copy for convenience to have a more reasonable and informative variable name.
-    map_height = map_data[0][1]; // Same as above.
-    map_elements_count = map_data[1][0]; // Same as above.
-    map_elements = map_data + 2; // Same as above.
-
-	t1 = SDL_GetTicks();
+	t1 = SDL_GetPerformanceCounter();
 	frames = 0;
 	fpsTimer = 0;
 	fps = 0;
 	worldTime = 0;
 	ticker = 0;
-	map_offset = 0.;
+	previous_map_offset = game.map_offset;
+	previous_x = player.x;
+	previous_y = player.y;
+	previous_angle = player.angle;
 
 	while(!quit) {
-		t2 = SDL_GetTicks();
-		delta = (t2 - t1) * 0.001;
+		profiler.frame++;
+		reset_frame_arena(&frame_arena);
+		frame_allocations = allocations_count();
+		platforms_composed = platforms.composed;
+		t2 = SDL_GetPerformanceCounter();
+		delta = (double)(t2 - t1) / SDL_GetPerformanceFrequency();
 		worldTime += delta;
         fpsTimer += delta;
-        ticker += (t2 - t1);
+        ticker += delta * 1000.;
 		if(fpsTimer > 0.5) {
 			fps = frames * 2;
 			frames = 0;
 			fpsTimer -= 0.5;
+			if (profile_overlay.visible) update_profile_overlay(&profile_overlay, glyphs);
         }
-        if (ticker >= TICK_PERIOD) { // TODO Add for i in ticker % TICK_PERIOD to stay stable in extremely low framerates
-            player.x_velocity = STARTING_X_VELOCITY * (1. + player.dashing_status() * 0.8); // Plus maybe later add acceleration over time.
-            map_offset += player.x_velocity;
-            if (map_offset >= map_length) {
-                map_offset = fmod(map_offset, map_length);
+        // Fixed timestep: run as many ticks as the elapsed time calls for, so the game runs at the same speed at any frame rate.
+        // Past MAX_TICKS_PER_FRAME the backlog is dropped, otherwise a machine too slow to keep up would fall further behind every frame.
+        ticks_this_frame = 0;
+        while (ticker >= TICK_PERIOD) {
+            if (ticks_this_frame == MAX_TICKS_PER_FRAME) {
+                ticker = fmod(ticker, TICK_PERIOD);
+                break;
             }
-            player.x = DEFAULT_X + player.dash_offset();
-            if (player.dashing_status()) player.y_velocity = 0;
-            else player.y += player.y_velocity;
-            if (cheaters_controls && player.y <= player.height/2) player.y = player.height/2;
-            if (cheaters_controls && player.y + player.height/2 >= map_height) player.y = map_height - player.height/2;
-            if (!cheaters_controls && !player.on_surface) {
-                player.y_velocity = fmin(DRAG, player.y_velocity + GRAVITY + player.y_acc);
-                if (player.y_velocity <= -(JUMP_STRENGTH * (1 + 0.3 * player.double_jump_ready))) player.y_acc = 0.; // If max velocity increase due to jumping achieved, stop accelerating. Multiplication by 1.3 to make the first jump a bit stronger than the second one.
+            previous_map_offset = game.map_offset;
+            previous_x = player.x;
+            previous_y = player.y;
+            previous_angle = player.angle;
+            {
+                ProfileScope scope(STAGE_TICK);
+                game_tick(&game, &player);
             }
-            player.angle = player.y_velocity / ((GRAVITY + DRAG) / 2) * 15;
-            if (!cheaters_controls) collision_status = player.detect_collisions(map_offset, vertical_map_offset, map_length, map_height, map_elements_count, map_elements);
-            // TODO Handle collision status
-            ticker = 0.;
+            if (game.input_log != NULL && game.input_log->finished) {
+                SDL_Log("Replay finished, %lld ticks diverged from the recording.", game.input_log->divergences);
+                quit = true;
+                break;
+            }
+            if (game.restarted) previous_map_offset = game.map_offset; // Start over without interpolating from where the last game ended.
+            if (game.restarted || (!game.cheaters_controls && game.collision_status >= 2)) { // The player respawned somewhere else, don't draw them flying there.
+                previous_x = player.x;
+                previous_y = player.y;
+            }
+            ticker -= TICK_PERIOD;
+            ticks_this_frame++;
         }
         t1 = t2;
 
-        if (player.y <= SCREEN_HEIGHT / 2) {
-            player_sprite_y = player.y;
-            vertical_map_offset = 0.;
+        // Draw the state in between the last two ticks, as far along as the time left over in ticker says.
+        alpha = ticker / TICK_PERIOD;
+        if (game.map_offset >= previous_map_offset) render_map_offset = previous_map_offset + (game.map_offset - previous_map_offset) * alpha;
+        else render_map_offset = fmod(previous_map_offset + (game.map_offset + map_length - previous_map_offset) * alpha, map_length); // The map looped in between.
+        render_x = previous_x + (player.x - previous_x) * alpha;
+        render_y = previous_y + (player.y - previous_y) * alpha;
+        render_angle = previous_angle + (player.angle - previous_angle) * alpha;
+
+        if (render_y <= SCREEN_HEIGHT / 2) {
+            player_sprite_y = render_y;
+            game.vertical_map_offset = 0.;
         }
-        else if (player.y > SCREEN_HEIGHT / 2 && player.y <= map_height - SCREEN_HEIGHT / 2) {
+        else if (render_y > SCREEN_HEIGHT / 2 && render_y <= map_height - SCREEN_HEIGHT / 2) {
             player_sprite_y  = SCREEN_HEIGHT / 2;
-            vertical_map_offset = player.y - SCREEN_HEIGHT / 2;
+            game.vertical_map_offset = render_y - SCREEN_HEIGHT / 2;
         } else {
-            player_sprite_y = player.y - map_height + SCREEN_HEIGHT;
-            vertical_map_offset = map_height - SCREEN_HEIGHT;
+            player_sprite_y = render_y - map_height + SCREEN_HEIGHT;
+            game.vertical_map_offset = map_height - SCREEN_HEIGHT;
         }
-        player_target_rect = {(int)(player.x - player.width/2.), (int)(player_sprite_y - player.height/2.), player.width, player.height}; // The rectangle in which player's sprite should be rendered.
+        player_target_rect = {(int)(render_x - player.width/2.), (int)(player_sprite_y - player.height/2.), player.width, player.height}; // The rectangle in which player's sprite should be rendered.
         rainbow_target_rect = { // The rectangle in which the rainbow effect should be rendered when the player is dashing.
-            (int)(player.x - player.height/2. - 80.), // Upper left corner x coordinate.
+            (int)(render_x - player.height/2. - 80.), // Upper left corner x coordinate.
             (int)(player_sprite_y - player.width/2. + 0.5 * (player.height - player.height/2.) + 20.), // Upper left corner y coordinate.
             player.width / 2 + 90., // Rectangle width.
             player.height/2 // Rectangle height.
         };
         SDL_RenderClear(renderer);
-		SDL_FillRect(screen, NULL, color_black);
-        draw_map(screen, map_offset, vertical_map_offset, map_length, map_elements_count, map_elements, color_green, color_brown);
-		DrawRectangle(screen, 4, 4, SCREEN_WIDTH - 8, 52, color_red, color_blue); // The info panel (points, FPS, lives etc.)
-		sprintf(text, "Time elapsed = %.1lf s  %.0lf FPS (Frames Per Second)", worldTime, fps);
-		DrawString(screen, screen->w / 2 - strlen(text) * 8 / 2, 10, text, charset);
-		sprintf(text, "Lives left = %d", player.lives);
-		DrawString(screen, screen->w / 2 - strlen(text) * 8 / 2, 26, text, charset);
-		sprintf(text, "Esc - quit, Z - jump, X - dash, D - toggle cheater's controls, N - new game.");
-		DrawString(screen, screen->w / 2 - strlen(text) * 8 / 2, 42, text, charset);
-        SDL_UpdateTexture(scrtex, NULL, screen->pixels, screen->pitch); // Copy data from the screen surface to scrtex texture.
-		SDL_RenderCopy(renderer, scrtex, NULL, NULL); // Render the scrtex onto the renderer.
-        if (player.dashing_status()) {
+        platforms.frame++; // Platform images drawn from now on are kept until the frame has been drawn.
+        { // With the geometry backend the map and the info panel go into one batch, sent to the renderer in a single go when uploading.
+            ProfileScope scope(STAGE_MAP);
+            if (geometry_backend) {
+                draw_map_geometry(&batch, render_map_offset, game.vertical_map_offset, &map, &platforms, ColorOf(color_green, screen->format), ColorOf(color_brown, screen->format));
+                draw_entities_geometry(&batch, render_map_offset, game.vertical_map_offset, map_length, &entities, ColorOf(color_pink, screen->format), ColorOf(color_yellow, screen->format));
+            } else if (incremental) {
+                scroll_map_layer(&map_layer, &map, &platforms, render_map_offset, game.vertical_map_offset, color_black, color_green, color_brown);
+                overlay_start = clear_overlay(&raster, &overlay_dirty);
+                draw_entities(&raster, render_map_offset, game.vertical_map_offset, map_length, &entities, color_pink, color_yellow);
+            } else {
+                RasterFill(&raster, NULL, color_black);
+                draw_map(&raster, render_map_offset, game.vertical_map_offset, &map, &platforms, color_green, color_brown);
+                draw_entities(&raster, render_map_offset, game.vertical_map_offset, map_length, &entities, color_pink, color_yellow);
+            }
+        }
+        {
+            ProfileScope scope(STAGE_HUD);
+            // Only re-rendered when the text has actually changed, i.e. every tenth of a second at most.
+            set_text_line(&time_line, arena_printf(&frame_arena, "Time elapsed = %.1lf s  %.0lf FPS (Frames Per Second)", worldTime, fps), glyphs);
+            set_text_line(&lives_line, arena_printf(&frame_arena, "Lives left = %d  Fairies = %d  Stars destroyed = %d", player.lives, entities.collected, entities.destroyed), glyphs);
+            if (geometry_backend) {
+                BatchRectangle(&batch, 4, 4, SCREEN_WIDTH - 8, 52, ColorOf(color_red, screen->format), ColorOf(color_blue, screen->format)); // The info panel (points, FPS, lives etc.)
+                BatchTextLine(&batch, SCREEN_WIDTH / 2 - time_line.width / 2, 10, &time_line);
+                BatchTextLine(&batch, SCREEN_WIDTH / 2 - lives_line.width / 2, 26, &lives_line);
+                BatchTextLine(&batch, SCREEN_WIDTH / 2 - controls_line.width / 2, 42, &controls_line);
+                if (profile_overlay.visible) BatchProfileOverlay(&batch, &profile_overlay, ColorOf(color_red, screen->format), ColorOf(color_blue, screen->format));
+            } else {
+                RasterRectangle(&raster, 4, 4, SCREEN_WIDTH - 8, 52, color_red, color_blue); // The info panel (points, FPS, lives etc.)
+                DrawTextLine(&raster, screen->w / 2 - time_line.width / 2, 10, &time_line);
+                DrawTextLine(&raster, screen->w / 2 - lives_line.width / 2, 26, &lives_line);
+                DrawTextLine(&raster, screen->w / 2 - controls_line.width / 2, 42, &controls_line);
+                if (profile_overlay.visible) DrawProfileOverlay(&raster, &profile_overlay, color_red, color_blue);
+            }
+        }
+        if (!geometry_backend) { // The software drawing recorded above actually happens here, on all the rasterizer's threads.
+            ProfileScope scope(STAGE_RASTER);
+            if (incremental) {
+                find_overlay_rects(&raster, overlay_start, &overlay_current); // Before the commands are gone.
+                Rasterize(&map_layer.raster);
+            }
+            Rasterize(&raster);
+        }
+        {
+            ProfileScope scope(STAGE_UPLOAD);
+            if (geometry_backend) FlushGeometry(&batch);
+            else if (incremental) { // Only the new strips of the map and the parts of the screen surface that changed.
+                upload_map_layer(&map_layer);
+                upload_overlay(screen, &overlay_dirty, &overlay_current, scrtex);
+                RenderMapLayer(renderer, &map_layer);
+                SDL_RenderCopy(renderer, scrtex, NULL, NULL);
+            } else {
+                SDL_UpdateTexture(scrtex, NULL, screen->pixels, screen->pitch); // Copy data from the screen surface to scrtex texture.
+                SDL_RenderCopy(renderer, scrtex, NULL, NULL); // Render the scrtex onto the renderer.
+            }
+        }
+        {
+            ProfileScope scope(STAGE_SPRITES);
+            if (player.dashing_status() && rainbow >= 0) {
+                SDL_RenderCopyEx( // Render player's sprite onto the renderer.
+                    renderer,
+                    atlas.texture,
+                    &atlas.frames[rainbow], // const SDL_Rect*        srcrect, the rainbow's frame within the atlas
+                    &rainbow_target_rect, // const SDL_Rect*        dstrect,
+                    render_angle,
+                    NULL, // Would take SDL_Point* center, but NULL means rotate about the center of the desitnation rectangle.
+                    SDL_FLIP_NONE
+                );
+            }
+            if (
             SDL_RenderCopyEx( // Render player's sprite onto the renderer.
                 renderer,
-                rainbow,
-                NULL, // const SDL_Rect*        srcrect, NULL means copy the entire srcrect
-                &rainbow_target_rect, // const SDL_Rect*        dstrect,
-                player.angle,
+                atlas.texture,
+                &atlas.frames[player.sprite()], // const SDL_Rect*        srcrect, the current frame within the atlas
+                &player_target_rect, // const SDL_Rect*        dstrect,
+                render_angle,
                 NULL, // Would take SDL_Point* center, but NULL means rotate about the center of the desitnation rectangle.
                 SDL_FLIP_NONE
-            );
-        }
-        if (
-        SDL_RenderCopyEx( // Render player's sprite onto the renderer.
-            renderer,
-            player.sprite(renderer),
-            NULL, // const SDL_Rect*        srcrect, NULL means copy the entire srcrect
-            &player_target_rect, // const SDL_Rect*        dstrect,
-            player.angle,
-            NULL, // Would take SDL_Point* center, but NULL means rotate about the center of the desitnation rectangle.
-            SDL_FLIP_NONE
-        ) != 0 ) SDL_Log(SDL_GetError());
-		SDL_RenderPresent(renderer);
+            ) != 0 ) SDL_Log(SDL_GetError());
+        }
+		if (screenshot_path != NULL) { // Save the finished frame before presenting it, the back buffer is undefined afterwards.
+			SDL_Surface *shot = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+			SDL_Rect viewport = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+			if (SDL_RenderReadPixels(renderer, &viewport, SDL_PIXELFORMAT_ARGB8888, shot->pixels, shot->pitch) != 0 || SDL_SaveBMP(shot, screenshot_path) != 0) {
+				SDL_Log("Error saving the screenshot %s: %s", screenshot_path, SDL_GetError());
+			}
+			SDL_FreeSurface(shot);
+			quit = true;
+		}
+		{
+			ProfileScope scope(STAGE_PRESENT);
+			SDL_RenderPresent(renderer);
+		}
+		pace_frame(&pacer);
 
-		// handling of events (if there were any)
+		// handling of events (if there were any). Inputs are queued for the next tick; while replaying, only quitting is up to the keyboard.
 		while(SDL_PollEvent(&event)) {
+			bool replaying = game.input_log != NULL && game.input_log->data != NULL;
 			switch(event.type) { // Aways processing a single event, so I break whenever I can, i.e. when I know the event has been fully processed.
 				case SDL_KEYDOWN:
 					if (event.key.keysym.sym == SDLK_ESCAPE) {quit = true; break;}
-					if (event.key.keysym.sym == SDLK_n) {new_game(&player, &map_offset); break;}
-					if (event.key.keysym.sym == SDLK_d) {toggle_cheaters_controls(&cheaters_controls, &player); break;}
-					if (cheaters_controls) {
-                        if (event.key.keysym.sym == SDLK_UP) {player.y_velocity = -6.0; break;}
-                        else if (event.key.keysym.sym == SDLK_DOWN) {player.y_velocity = 6.0; break;}
-					} else {
-                        if (event.key.keysym.sym == SDLK_z) {
-                            player.jump();
-                            break;
-                        }
-                        if (event.key.keysym.sym == SDLK_x) {
-                            player.dash();
-                            break;
-                        }
+					if (event.key.keysym.sym == SDLK_p) { // Not a game input, so neither recorded nor blocked by replaying.
+						profile_overlay.visible ^= 1;
+						if (profile_overlay.visible) update_profile_overlay(&profile_overlay, glyphs);
+						break;
 					}
+					if (replaying) break;
+					if (event.key.keysym.sym == SDLK_n) queue_action(&game, ACTION_NEW_GAME);
+					else if (event.key.keysym.sym == SDLK_d) queue_action(&game, ACTION_TOGGLE_CHEATS);
+					else if (event.key.keysym.sym == SDLK_UP) queue_action(&game, ACTION_UP);
+					else if (event.key.keysym.sym == SDLK_DOWN) queue_action(&game, ACTION_DOWN);
+					else if (event.key.keysym.sym == SDLK_z) queue_action(&game, ACTION_JUMP);
+					else if (event.key.keysym.sym == SDLK_x) queue_action(&game, ACTION_DASH);
+					else queue_action(&game, ACTION_OTHER_KEY);
+					break;
 				case SDL_KEYUP:
-                    if (cheaters_controls) {
-                        player.y_velocity = 0.;
-                        break;
-					}
-					else if (event.key.keysym.sym == SDLK_z) {
-                        player.y_acc = 0.;
-                        break;
-					} else break;
+					if (replaying) break;
+					if (event.key.keysym.sym == SDLK_z) queue_action(&game, ACTION_JUMP_RELEASE);
+					else queue_action(&game, ACTION_OTHER_KEY);
+					break;
 				case SDL_QUIT:
 					quit = true; break;
             }
         }
+		// Everything else a frame needs is kept from frame to frame, so once it's all grown to size, nothing should be allocated any more.
+		// Only allocations through SDL's memory functions are counted, see MemoryCounter, so this can't catch the C library allocating behind our back.
+		frame_allocations = allocations_count() - frame_allocations;
+		if (check_allocations && ++frames_drawn > ALLOCATION_WARMUP_FRAMES && platforms.composed == platforms_composed) {
+			if (frame_allocations != 0) SDL_Log("Frame %lld made %d heap allocations!", frames_drawn, frame_allocations);
+			SDL_assert_release(frame_allocations == 0);
+		}
 		frames++;
+		drain_profiler();
     };
 
-	// freeing all surfaces
-	SDL_FreeSurface(charset);
-	SDL_FreeSurface(screen);
-	SDL_DestroyTexture(scrtex);
-	SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
-
-	SDL_Quit();
-	return 0;
+	report_frame_pacing(&pacer);
+	return 0; // Everything gets freed by cleanup on the way out.
 };
+#endif
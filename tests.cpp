@@ -0,0 +1,194 @@
+// Checks of the game's internals that are easy to get subtly wrong, run headless. Build and run with `make test`, which fails
+// if any check does. Like bench.cpp, this includes main.cpp for everything but main().
+#define RUA_NO_MAIN
+#include "main.cpp"
+
+int failures = 0;
+
+void check(bool condition, const char *what) {
+    if (condition) return;
+    SDL_Log("FAILED: %s", what);
+    failures++;
+}
+
+// Whether the platform's span overlaps the map stretch [from, to], which may run past the end of the looping map, in any lap.
+bool stretch_overlaps(double *element, double from, double to, double map_length) {
+    for (int lap = -1; lap <= 2; lap++) {
+        if (element[0] + lap * map_length <= to && element[0] + element[2] + lap * map_length >= from) return true;
+    }
+    return false;
+}
+
+// A map index query must return every platform a full scan would find, including the ones running past the end of the map,
+// which wrapped-around queries have to find at the start of the map.
+void test_map_index_wraparound() {
+    double map_length = 5000; // Not a multiple of INDEX_BUCKET_WIDTH, so buckets get stretched to tile the map.
+    double elements[][4] = {
+        {4800, 500, 400, 50}, // Runs past the end of the map by 200.
+        {4990, 600, 1000, 50}, // Past the end by a few buckets.
+        {100, 700, 300, 50},
+        {2500, 800, 200, 50},
+        {4000, 900, 1000, 50}, // Ends exactly at the end of the map.
+    };
+    int count = sizeof(elements) / sizeof(elements[0]);
+    MapIndex index;
+    double *out[MAX_QUERY_RESULTS];
+    build_map_index(&index, map_length, count, elements);
+
+    int found = query_map_index(&index, map_length + 50, map_length + 100, out, MAX_QUERY_RESULTS);
+    bool straddling = false;
+    for (int i = 0; i < found; i++) straddling |= out[i] == elements[0];
+    check(straddling, "a wrapped-around query finds the platform straddling the end of the map");
+
+    Uint32 seed = 12345;
+    int mismatches = 0;
+    for (int q = 0; q < 100000; q++) {
+        double from = xorshift32(&seed) % (Uint32)(2 * map_length), to = from + xorshift32(&seed) % 600;
+        found = query_map_index(&index, from, to, out, MAX_QUERY_RESULTS);
+        for (int e = 0; e < count; e++) {
+            bool returned = false;
+            for (int i = 0; i < found; i++) returned |= out[i] == elements[e];
+            if (stretch_overlaps(elements[e], from, to, map_length) && !returned) mismatches++;
+        }
+        for (int i = 1; i < found; i++) mismatches += out[i - 1] >= out[i]; // Ascending platform order, no duplicates.
+    }
+    check(mismatches == 0, "map index queries return every overlapping platform, once each, in platform order");
+    free_map_index(&index);
+}
+
+// Rasterizing with any number of bands must give the same pixels as drawing directly, also for rectangles of degenerate sizes,
+// whose sides DrawRectangle() draws outside of their rectangle, right at the band boundaries.
+void test_raster_bands() {
+    int sizes[] = {-2, -1, 0, 1, 2, 3, 40, 271};
+    int sizes_count = sizeof(sizes) / sizeof(sizes[0]), band_counts[] = {1, 2, 7, 15, RASTER_MAX_BANDS};
+    SDL_Surface *direct = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    SDL_Surface *banded = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    for (int b = 0; b < (int)(sizeof(band_counts) / sizeof(band_counts[0])); b++) {
+        Rasterizer raster;
+        Uint32 seed = 777;
+        bool same = true;
+        init_rasterizer(&raster, banded, band_counts[b]);
+        SDL_FillRect(direct, NULL, 0);
+        RasterFill(&raster, NULL, 0);
+        for (int r = 0; r < 2000; r++) {
+            int x = xorshift32(&seed) % SCREEN_WIDTH, y = xorshift32(&seed) % (SCREEN_HEIGHT + 2) - 1;
+            int w = sizes[xorshift32(&seed) % sizes_count], h = sizes[xorshift32(&seed) % sizes_count];
+            if (r % 4 == 0) y = y / 40 * 40; // Right on a band boundary, for most band counts.
+            DrawRectangle(direct, x, y, w, h, 0xFF000000 | r, 0xFF800000 | r);
+            RasterRectangle(&raster, x, y, w, h, 0xFF000000 | r, 0xFF800000 | r);
+        }
+        RasterRectangle(&raster, 709, 520, 271, 0, 0xFFFFFFFF, 0xFFFFFFFF);
+        DrawRectangle(direct, 709, 520, 271, 0, 0xFFFFFFFF, 0xFFFFFFFF);
+        Rasterize(&raster);
+        for (int y = 0; y < SCREEN_HEIGHT; y++) {
+            same &= memcmp((Uint8*)direct->pixels + y * direct->pitch, (Uint8*)banded->pixels + y * banded->pitch, SCREEN_WIDTH * 4) == 0;
+        }
+        if (!same) SDL_Log("%d bands differ from drawing directly.", raster.bands_count);
+        check(same, "rasterizing in bands draws the same pixels as drawing directly");
+        free_rasterizer(&raster);
+    }
+    SDL_FreeSurface(direct);
+    SDL_FreeSurface(banded);
+}
+
+// Every platform the endless generator places must be reachable from the one before it, with both as wide as they really are, and so must
+// the next chunk's anchor from the end of a chunk.
+void test_endless_reachable() {
+    int width = 80, height = 60;
+    check(platform_reachable(1000, 40, 1000, -200, width, height) && !platform_reachable(150, 40, 150, -200, width, height),
+        "landing past the end of a narrow platform doesn't make it reachable");
+    Map map = {};
+    open_endless_stream(7, width, height, &map);
+    MapStream *stream = map.stream;
+    ChunkSlot slot = {};
+    slot.elements = (double(*)[4])SDL_malloc(stream->chunk_capacity * sizeof(*slot.elements));
+    double platforms[64][4]; // The chunk's platforms, with the pieces the last one is stretched out of joined back together.
+    int unreachable = 0;
+    for (int c = 0; c < 2000; c++) {
+        int count = 0;
+        slot.chunk = c;
+        generate_chunk(stream, &slot);
+        for (int i = 0; i < slot.elements_count; i++) {
+            double *piece = slot.elements[i];
+            if (count > 0 && platforms[count - 1][0] + platforms[count - 1][2] == piece[0] && platforms[count - 1][1] == piece[1]) platforms[count - 1][2] += piece[2];
+            else memcpy(platforms[count++], piece, sizeof(platforms[0]));
+        }
+        platforms[count][0] = (c + 1) * stream->chunk_width; // The next chunk's anchor.
+        platforms[count][1] = ENDLESS_ANCHOR_Y;
+        platforms[count][2] = ENDLESS_ANCHOR_WIDTH;
+        for (int i = 0; i < count; i++) {
+            double *from = platforms[i], *to = platforms[i + 1];
+            unreachable += !platform_reachable(from[2], to[0] - from[0] - from[2], to[2], from[1] - to[1], width, height);
+        }
+    }
+    check(unreachable == 0, "every endless platform is reachable from the one before it");
+    SDL_free(slot.elements);
+    free_map(&map);
+}
+
+// Cached images must stay around for as long as anybody holds a handle to them, and be freed once nobody but the cache does.
+void test_resource_cache() {
+    ResourceCache cache = {};
+    SDL_Surface *surface = SDL_CreateRGBSurface(0, 8, 8, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    {
+        SurfaceHandle held = cache_surface(&cache, "held.bmp", 0, surface);
+        cache_surface(&cache, "unused.bmp", 0, SDL_CreateRGBSurface(0, 8, 8, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000));
+        SurfaceHandle copy = cached_surface(&cache, "held.bmp", 0);
+        check(copy == surface && surface->refcount == 3, "handles to a cached image share it, each holding a reference");
+        check(cached_surface(&cache, "held.bmp", SDL_PIXELFORMAT_ARGB8888) == NULL, "an image is cached per pixel format");
+        trim_resource_cache(&cache);
+        check(cache.count == 1 && cached_surface(&cache, "held.bmp", 0) == surface, "trimming the cache only frees the images nobody holds");
+    }
+    check(surface->refcount == 1, "destroyed handles give their references back");
+    trim_resource_cache(&cache);
+    check(cache.count == 0, "trimming the cache frees an image once its handles are gone");
+}
+
+// Entities are found for the collision test through the index around the player, including right after the map has looped around,
+// and each one only counts once.
+void test_entity_collisions() {
+    double map_length = 20000, records[][4] = {
+        {5, 500, FAIRY_SIZE, FAIRY_SIZE}, // Just past the start of the map, reached by looping around.
+        {400, 500, STAR_SIZE, STAR_SIZE},
+        {800, 500, STAR_SIZE, STAR_SIZE},
+        {10000, 500, FAIRY_SIZE, FAIRY_SIZE} // Never near the player.
+    };
+    Uint8 kinds[] = {ENTITY_FAIRY, ENTITY_STAR, ENTITY_STAR, ENTITY_FAIRY};
+    EntityPool pool;
+    init_entity_pool(&pool);
+    pool.records_count = 4;
+    pool.records = (double(*)[4])SDL_malloc(sizeof(records));
+    pool.record_kind = (Uint8*)SDL_malloc(sizeof(kinds));
+    memcpy(pool.records, records, sizeof(records));
+    memcpy(pool.record_kind, kinds, sizeof(kinds));
+    build_entity_index(&pool, map_length);
+
+    double map_offset = map_length - 100; // The fairy is at screen x 105.
+    update_entities(&pool, map_offset, map_length);
+    check(collide_entities(&pool, map_offset, map_length, DEFAULT_X, 516, 60, 40, false) == 0 && pool.collected == 1, "a fairy past the end of the map is collected");
+    check(collide_entities(&pool, map_offset, map_length, DEFAULT_X, 516, 60, 40, false) == 0 && pool.collected == 1, "a fairy is only collected once");
+    map_offset = 310; // The first star is at screen x 90.
+    update_entities(&pool, map_offset, map_length);
+    check(collide_entities(&pool, map_offset, map_length, DEFAULT_X, 516, 60, 40, false) == 2, "crashing into a star kills");
+    map_offset = 710;
+    update_entities(&pool, map_offset, map_length);
+    check(collide_entities(&pool, map_offset, map_length, DEFAULT_X, 516, 60, 40, true) == 0 && pool.destroyed == 1, "dashing through a star destroys it");
+    check(pool.collected == 1, "entities away from the player are left alone");
+    free_entity_pool(&pool);
+}
+
+int main(int argc, char **argv) {
+    init_frame_arena(&frame_arena, FRAME_ARENA_BYTES);
+    test_map_index_wraparound();
+    test_raster_bands();
+    test_endless_reachable();
+    test_resource_cache();
+    test_entity_collisions();
+    free_frame_arena(&frame_arena);
+    if (failures > 0) {
+        SDL_Log("%d checks failed.", failures);
+        return 1;
+    }
+    SDL_Log("All checks passed.");
+    return 0;
+}